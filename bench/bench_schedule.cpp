@@ -0,0 +1,96 @@
+/**
+ * @file bench_schedule.cpp
+ * @brief Host-side throughput benchmark for the scheduling core in dimmer_core.h.
+ *
+ * Build and run with `pio run -e native && .pio/build/native/program`.  Reports nanoseconds per operation on the host, which is only useful
+ * relative to earlier runs; for AVR cycle counts see isr_cycles.cpp.
+ */
+
+#include <chrono>
+#include <cstdio>
+
+#include "dimmer_core.h"
+
+// the default firmware build: 8 channels on the Krida pins, gate masks as PORTB, PORTC, PORTD
+typedef basic_schedule_t<8, 3> schedule_t;
+typedef basic_command_list_t<8> command_list_t;
+static const uint8_t channel_masks[8][3] = {
+  {0x02, 0, 0}, {0x01, 0, 0}, {0, 0, 0x80}, {0, 0, 0x40}, {0, 0, 0x20}, {0, 0, 0x10}, {0, 0, 0x08}, {0x04, 0, 0}
+};
+
+static uint32_t rng = 12345;
+
+static uint16_t next_random() {
+  rng = rng * 1103515245 + 12345;
+  return rng >> 16;
+}
+
+static uint16_t random_counts() {
+  return 2000 + next_random() % 16000;
+}
+
+volatile uint32_t sink; // keeps results observable so the loops aren't optimised away
+
+template<typename F>
+static void run(const char *name, long iterations, F body) {
+  auto start = std::chrono::steady_clock::now();
+  for(long i = 0; i < iterations; i++) {
+    body();
+  }
+  auto end = std::chrono::steady_clock::now();
+  double ns = std::chrono::duration<double, std::nano>(end - start).count() / iterations;
+  printf("%-36s %10.1f ns/op %14.0f ops/s\n", name, ns, 1e9 / ns);
+}
+
+int main() {
+  const long iterations = 2000000;
+  command_list_t sorted;
+  schedule_t schedule;
+
+  clear_commands(&sorted);
+  run("full rebuild (8 channels changed)", iterations, [&]() {
+    for(int c = 0; c < 8; c++) {
+      insert_command(&sorted, c, random_counts());
+    }
+    build_schedule(&schedule, &sorted, channel_masks);
+    sink += schedule.slots;
+  });
+
+  clear_commands(&sorted);
+  run("single channel update + rebuild", iterations, [&]() {
+    insert_command(&sorted, next_random() & 7, random_counts());
+    build_schedule(&schedule, &sorted, channel_masks);
+    sink += schedule.slots;
+  });
+
+  run("unchanged channel update", iterations, [&]() {
+    uint8_t c = next_random() & 7;
+    for(int i = 0; i < 8; i++) {
+      if(sorted.channels[i] == c) {
+        sink += insert_command(&sorted, c, sorted.times[i]);
+      }
+    }
+  });
+
+  // worst case for the ISR: 8 separate slots all overdue at once
+  for(int c = 0; c < 8; c++) {
+    insert_command(&sorted, c, 1000 + c * 100);
+  }
+  build_schedule(&schedule, &sorted, channel_masks);
+  run("slot walk, 8 slots due", iterations, [&]() {
+    uint8_t fire[3] = {0, 0, 0};
+    uint16_t late = 0;
+    sink += walk_schedule(&schedule, 0, 2000, fire, late) + fire[0] + fire[2] + late;
+  });
+
+  int32_t period_q8 = (int32_t)20000 << 8;
+  run("pll edge correction", iterations, [&]() {
+    int16_t error = pll_phase_error(next_random() % 800, 19999);
+    if(pll_in_capture(error)) {
+      period_q8 = pll_integrate(period_q8, error);
+      sink += pll_top(period_q8, error);
+    }
+  });
+
+  return 0;
+}
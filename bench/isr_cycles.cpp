@@ -0,0 +1,195 @@
+/**
+ * @file isr_cycles.cpp
+ * @brief AVR cycle-count regression check for the scheduling core and the Timer1 ISRs, run under simavr.
+ *
+ * Built as the isr_cycles env (`pio run -e isr_cycles`), which links in the whole firmware with -DISR_CYCLES, and run by
+ * tools/check_isr_cycles.sh.  Each measurement is taken with interrupts off and has the cost of an empty call subtracted; a result over its
+ * budget prints FAIL and the script exits non-zero.
+ *
+ * The core functions are timed on Timer1 unprescaled.  The ISRs are then called through their vectors with Timer1 stopped, so TCNT1 holds
+ * whatever the case needs, and timed on Timer2 at /8, to 8 cycles.  Every interrupt source is masked first, so the reti at the end of a
+ * vector can't let another ISR into the measurement.
+ *
+ * The budgets are the ceilings the firmware's timing relies on:
+ * - no ISR may run longer than MIN_INTERRUPT_COUNTS, the closest two compare matches are ever scheduled, or the slot after a merge window
+ *   fires late; the walk of 8 separate slots is the compare ISR's worst case, and the half-cycle start with a schedule flip the capture ISR's
+ * - a full rebuild, every channel moved and the schedule built, should take at most a tenth of a 60Hz half-cycle, leaving loop() the rest
+ */
+
+#include <Arduino.h>
+#include <avr/sleep.h>
+
+#include "dimmer_core.h"
+#include "uart.h"
+
+const uint16_t ISR_BUDGET_CYCLES = MIN_INTERRUPT_COUNTS * 8; // TCNT1 counts are 8 cycles
+const uint16_t REBUILD_BUDGET_CYCLES = F_CPU / 120 / 10;
+const uint16_t INSERT_BUDGET_CYCLES = 1000; // a channel moved from one end of the list to the other
+const uint16_t BUILD_BUDGET_CYCLES = REBUILD_BUDGET_CYCLES - 8 * INSERT_BUDGET_CYCLES; // 8 separate slots
+
+// the firmware, built for its default 8 channels on the Krida pins
+void firmware_setup();
+void zero_cross_int();
+void set_channel_level(uint8_t channel, uint16_t level);
+void slew_step();
+void update_schedule();
+extern "C" void TIMER1_CAPT_vect(void);
+extern "C" void TIMER1_COMPA_vect(void);
+
+// gate masks as PORTB, PORTC, PORTD, as the firmware resolves them
+typedef basic_schedule_t<8, 3> bench_schedule_t;
+typedef basic_command_list_t<8> bench_command_list_t;
+static const uint8_t bench_masks[8][3] = {
+  {0x02, 0, 0}, {0x01, 0, 0}, {0, 0, 0x80}, {0, 0, 0x40}, {0, 0, 0x20}, {0, 0, 0x10}, {0, 0, 0x08}, {0x04, 0, 0}
+};
+
+static bench_command_list_t sorted;
+static bench_schedule_t schedule;
+static volatile uint8_t sink;
+static bool failed = false;
+
+static void __attribute__((noinline)) empty_call() {
+  sink = 0;
+}
+
+static void __attribute__((noinline)) walk_call() {
+  uint8_t fire[3] = {0, 0, 0};
+  uint16_t late = 0;
+  sink = walk_schedule(&schedule, 0, 2000, fire, late);
+}
+
+static void __attribute__((noinline)) insert_call() {
+  sink = insert_command(&sorted, 0, 1800); // from the front to behind channel 7's 1700: the far end of the list
+}
+
+static void __attribute__((noinline)) build_call() {
+  build_schedule(&schedule, &sorted, bench_masks);
+  sink = schedule.slots;
+}
+
+static void capt_call() {
+  TCNT1 = 0; // the wrap
+  TIMER1_CAPT_vect();
+}
+
+static void compa_call() {
+  TCNT1 = 17500; // past every slot, so one interrupt walks all 8
+  TIMER1_COMPA_vect();
+}
+
+static uint16_t measure(void (*call)()) {
+  cli();
+  uint16_t start = TCNT1;
+  call();
+  uint16_t cycles = TCNT1 - start;
+  sei();
+  return cycles;
+}
+
+/**
+ * @brief Time a call on Timer2 at /8, with Timer1 stopped; 0xffff if it ran past Timer2's range.
+ */
+static uint16_t measure_stopped(void (*call)()) {
+  cli();
+  TIFR2 = (1 << TOV2);
+  TCNT2 = 0;
+  call();
+  uint8_t ticks = TCNT2;
+  bool overflowed = TIFR2 & (1 << TOV2);
+  cli(); // a vector's reti set I again
+  return overflowed ? 0xffff : ticks * 8;
+}
+
+static void print(const char *text) {
+  while(*text) {
+    uart_write(*text++);
+  }
+}
+
+static void print_uint(uint16_t value) {
+  char digits[6];
+  uint8_t n = 0;
+  do {
+    digits[n++] = '0' + value % 10;
+    value /= 10;
+  } while(value);
+  while(n) {
+    uart_write(digits[--n]);
+  }
+}
+
+static void report(const char *name, uint16_t cycles, uint16_t budget) {
+  print(name);
+  print(": ");
+  print_uint(cycles);
+  print(" cycles (budget ");
+  print_uint(budget);
+  print(") ");
+  print(cycles <= budget ? "PASS\n" : "FAIL\n");
+  failed |= cycles > budget;
+}
+
+/**
+ * @brief Bring the firmware up, then freeze it: every interrupt masked and Timer1 stopped, with a locked PLL and 8 separate slots
+ * published for the next half-cycle.
+ */
+static void prepare_firmware() {
+  uart_flush();
+  firmware_setup();
+  uart_flush();
+  cli();
+  EIMSK = 0;
+  TIMSK0 = 0;
+  TIMSK1 = 0;
+  TCCR1B &= ~((1 << CS12) | (1 << CS11) | (1 << CS10));
+  TCCR2A = 0;
+  TCCR2B = (1 << CS21);
+  TIMSK2 = 0;
+
+  // lock the PLL on a steady 50Hz: every edge lands exactly one half period after the last
+  for(int i = 0; i < PLL_LOCK_EDGES; i++) {
+    TCNT1 = 20000;
+    zero_cross_int();
+  }
+  for(int i = 0; i < 8; i++) {
+    set_channel_level(i, 0x1fff + 0x2000 * i); // far enough apart that each has its own slot
+  }
+  for(int i = 0; i < 255; i++) {
+    slew_step(); // well past the power-on sequence, which lets a channel on every 8 steps
+  }
+  update_schedule();
+}
+
+void setup() {
+  uart_begin(115200);
+  TCCR1A = 0;
+  TCCR1B = (1 << CS10); // no prescaler: one count per cycle
+  uint16_t overhead = measure(empty_call);
+
+  for(int i = 0; i < 8; i++) {
+    sorted.times[i] = 1000 + i * 100;
+    sorted.channels[i] = i;
+  }
+  build_schedule(&schedule, &sorted, bench_masks);
+  report("walk_schedule, 8 slots", measure(walk_call) - overhead, ISR_BUDGET_CYCLES);
+  report("build_schedule, 8 slots", measure(build_call) - overhead, BUILD_BUDGET_CYCLES);
+  report("insert_command, 7 places", measure(insert_call) - overhead, INSERT_BUDGET_CYCLES);
+
+  prepare_firmware();
+  overhead = measure_stopped(empty_call);
+  uint16_t capt = measure_stopped(capt_call);
+  uint16_t compa = measure_stopped(compa_call);
+  sei(); // only the UART's interrupts are left unmasked, and report() needs them to drain
+  report("TIMER1_CAPT_vect, half-cycle start", capt == 0xffff ? capt : capt - overhead, ISR_BUDGET_CYCLES);
+  report("TIMER1_COMPA_vect, 8 slots", compa == 0xffff ? compa : compa - overhead, ISR_BUDGET_CYCLES);
+  print(failed ? "isr_cycles: FAIL\n" : "isr_cycles: PASS\n");
+
+  uart_flush();
+  // simavr exits when the CPU sleeps with interrupts off
+  cli();
+  sleep_enable();
+  sleep_cpu();
+}
+
+void loop() {
+}
@@ -0,0 +1,16 @@
+/**
+ * @file crc8.h
+ * @brief CRC-8, polynomial 0x07, shared by the frame protocol and the EEPROM store.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+inline uint8_t crc8_update(uint8_t crc, uint8_t data) {
+  crc ^= data;
+  for(int i = 0; i < 8; i++) {
+    crc = crc & 0x80 ? (crc << 1) ^ 0x07 : crc << 1;
+  }
+  return crc;
+}
@@ -0,0 +1,298 @@
+/**
+ * @file dimmer_core.h
+ * @brief Hardware-independent scheduling core: schedule building, the ISR slot walk and the zero-cross PLL arithmetic.
+ *
+ * Everything here is plain data in and out, with no registers or Arduino calls, so the same code runs in the firmware (src/main.cpp) and
+ * natively on the host for benchmarking (bench/).  All functions are inline so the ISRs pay nothing for the split.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+// 64 is the minimum counts between interrupts: anything due closer than this to a compare match is fired by that match
+const uint16_t MIN_INTERRUPT_COUNTS = 64;
+
+// firing time of a channel that is switched off; never reached within a half-cycle
+const uint16_t COMMAND_OFF_TIME = 0xffff;
+
+/**
+ * @brief Every channel's firing time, sorted, as parallel arrays.
+ *
+ * Times keep the full TCNT1 resolution (0.5us); the channel of each time is held alongside rather than packed into its low bits.  The list
+ * always holds one entry per channel.
+ */
+template<uint8_t CHANNEL_COUNT>
+struct basic_command_list_t {
+  uint16_t times[CHANNEL_COUNT]; // ascending
+  uint8_t channels[CHANNEL_COUNT];
+};
+
+/**
+ * @brief Fill a command list with every channel switched off.
+ */
+template<uint8_t CHANNEL_COUNT>
+inline void clear_commands(basic_command_list_t<CHANNEL_COUNT> *list) {
+  for(int i = 0; i < CHANNEL_COUNT; i++) {
+    list->times[i] = COMMAND_OFF_TIME;
+    list->channels[i] = i;
+  }
+}
+
+/**
+ * @brief One half-cycle's firing table, sorted by firing time.
+ *
+ * Each slot is one compare match: channels whose firing times fall within MIN_INTERRUPT_COUNTS of the slot's first channel share the slot, and
+ * masks holds the combined gate mask in the output's own layout (one byte per port, or one byte per shift register) so the ISR never decodes
+ * a channel.  Unused slots have time 0xffff.
+ *
+ * @tparam CHANNEL_COUNT number of channels, up to 24
+ * @tparam MASK_BYTES size of one gate mask
+ */
+template<uint8_t CHANNEL_COUNT, uint8_t MASK_BYTES>
+struct basic_schedule_t {
+  uint16_t times[CHANNEL_COUNT+1]; // one past the last slot is always 0xffff, so the ISR can rearm from it
+  uint8_t masks[CHANNEL_COUNT][MASK_BYTES];
+  uint8_t slots;
+};
+
+/**
+ * @brief Fill a schedule that fires nothing.
+ */
+template<uint8_t CHANNEL_COUNT, uint8_t MASK_BYTES>
+inline void clear_schedule(basic_schedule_t<CHANNEL_COUNT, MASK_BYTES> *schedule) {
+  for(int i = 0; i < CHANNEL_COUNT; i++) {
+    schedule->times[i] = 0xffff;
+    for(int b = 0; b < MASK_BYTES; b++) {
+      schedule->masks[i][b] = 0;
+    }
+  }
+  schedule->times[CHANNEL_COUNT] = 0xffff;
+  schedule->slots = 0;
+}
+
+/**
+ * @brief Move one channel to a new firing time in a sorted command list.
+ *
+ * The channel's entry is found by a linear scan and slid past its neighbours with an insertion step, so an update costs O(n) and an
+ * unchanged time costs nothing beyond the scan.
+ *
+ * @param channel channel number
+ * @param counts firing time in TCNT1 counts from the zero cross, or COMMAND_OFF_TIME
+ * @return true if the list changed
+ */
+template<uint8_t CHANNEL_COUNT>
+inline bool insert_command(basic_command_list_t<CHANNEL_COUNT> *list, uint8_t channel, uint16_t counts) {
+  uint8_t pos = 0;
+  while(list->channels[pos] != channel) {
+    pos++;
+  }
+  if(list->times[pos] == counts) {
+    return false;
+  }
+  while(pos > 0 && list->times[pos-1] > counts) {
+    list->times[pos] = list->times[pos-1];
+    list->channels[pos] = list->channels[pos-1];
+    pos--;
+  }
+  while(pos < CHANNEL_COUNT - 1 && list->times[pos+1] < counts) {
+    list->times[pos] = list->times[pos+1];
+    list->channels[pos] = list->channels[pos+1];
+    pos++;
+  }
+  list->times[pos] = counts;
+  list->channels[pos] = channel;
+  return true;
+}
+
+/**
+ * @brief A channel's firing time in a command list.
+ */
+template<uint8_t CHANNEL_COUNT>
+inline uint16_t command_time(const basic_command_list_t<CHANNEL_COUNT> *list, uint8_t channel) {
+  uint8_t pos = 0;
+  while(list->channels[pos] != channel) {
+    pos++;
+  }
+  return list->times[pos];
+}
+
+/**
+ * @brief One half-cycle of slew limiting: move a firing time towards its target, but no more than limit counts earlier.
+ *
+ * Only brightening is limited, since that is what draws inrush; a later target, including COMMAND_OFF_TIME, is taken at once.  A channel
+ * that is off, or firing later than start, ramps from start.
+ *
+ * @param limit counts per half-cycle, 0 for no limit
+ * @param start the dimmest firing time, i.e. the end of the half-cycle
+ * @return the firing time for this half-cycle
+ */
+inline uint16_t slew_counts(uint16_t current, uint16_t target, uint16_t limit, uint16_t start) {
+  if(current > start) {
+    current = start;
+  }
+  if(limit == 0 || target >= current) {
+    return target;
+  }
+  return current - target > limit ? current - limit : target;
+}
+
+/**
+ * @brief Build a schedule from a sorted command list.
+ *
+ * Channels that fall within MIN_INTERRUPT_COUNTS of the first channel in a slot are merged into that slot, so a scene with many channels at the
+ * same level costs one compare interrupt instead of one per channel.  Switched-off channels are left out altogether.
+ *
+ * @param channel_masks each channel's gate mask
+ */
+template<uint8_t CHANNEL_COUNT, uint8_t MASK_BYTES>
+inline void build_schedule(basic_schedule_t<CHANNEL_COUNT, MASK_BYTES> *next, const basic_command_list_t<CHANNEL_COUNT> *sorted,
+                           const uint8_t (*channel_masks)[MASK_BYTES]) {
+  clear_schedule(next);
+  uint8_t slots = 0;
+  for(int i = 0; i < CHANNEL_COUNT; i++) {
+    uint16_t time = sorted->times[i];
+    uint8_t channel = sorted->channels[i];
+    if(time == COMMAND_OFF_TIME) {
+      break; // sorted, so everything after this is off too
+    }
+    if(slots == 0 || time > next->times[slots-1] + MIN_INTERRUPT_COUNTS) {
+      next->times[slots++] = time;
+    }
+    for(int b = 0; b < MASK_BYTES; b++) {
+      next->masks[slots-1][b] |= channel_masks[channel][b];
+    }
+  }
+  next->slots = slots;
+}
+
+// spacing of staggered channels: just over MIN_INTERRUPT_COUNTS, so build_schedule() gives each its own slot
+const uint16_t STAGGER_COUNTS = MIN_INTERRUPT_COUNTS + 2;
+
+/**
+ * @brief Spread coincident firing times apart, to flatten the inrush and EMI peak of many triacs firing at once.
+ *
+ * Channels that build_schedule() would merge into one slot are instead spaced STAGGER_COUNTS apart, centred on their mean firing time so the
+ * group's total power is unchanged to first order (each channel moves by at most half the group's spread), then the whole node is shifted by
+ * offset so nodes sharing a supply don't line up either.  A group that would spread into the one before it is pushed later instead, so every
+ * channel keeps its own slot and stays in order.  Nothing is pushed past latest, though: a channel beyond TOP would never fire at all, so a
+ * large offset or a crowded end of the half-cycle piles channels up at latest to share a slot instead.
+ *
+ * @param sorted commands as maintained by insert_command()
+ * @param staggered the spread commands, to pass to build_schedule() in place of sorted
+ * @param offset node offset in TCNT1 counts, positive for later
+ * @param latest latest firing time allowed, in TCNT1 counts
+ */
+template<uint8_t CHANNEL_COUNT>
+inline void stagger_commands(const basic_command_list_t<CHANNEL_COUNT> *sorted, basic_command_list_t<CHANNEL_COUNT> *staggered, int16_t offset,
+                             uint16_t latest) {
+  int32_t previous = (int32_t)MIN_INTERRUPT_COUNTS - STAGGER_COUNTS;
+  int i = 0;
+  while(i < CHANNEL_COUNT && sorted->times[i] != COMMAND_OFF_TIME) {
+    int end = i + 1;
+    uint32_t sum = sorted->times[i];
+    while(end < CHANNEL_COUNT && sorted->times[end] <= sorted->times[i] + MIN_INTERRUPT_COUNTS) {
+      sum += sorted->times[end++];
+    }
+    int n = end - i;
+    int32_t centre = sum / n + offset;
+    for(int k = 0; k < n; k++) {
+      int32_t time = centre + (int32_t)(2 * k - (n - 1)) * STAGGER_COUNTS / 2;
+      if(time < previous + STAGGER_COUNTS) {
+        time = previous + STAGGER_COUNTS;
+      }
+      if(time > latest) {
+        time = latest;
+      }
+      staggered->times[i + k] = time;
+      staggered->channels[i + k] = sorted->channels[i + k];
+      previous = time;
+    }
+    i = end;
+  }
+  for(; i < CHANNEL_COUNT; i++) {
+    staggered->times[i] = COMMAND_OFF_TIME;
+    staggered->channels[i] = sorted->channels[i];
+  }
+}
+
+/**
+ * @brief The compare ISR's slot walk: collect the gate masks of every slot due by now + MIN_INTERRUPT_COUNTS.
+ *
+ * @param slot first unfired slot
+ * @param now TCNT1 at ISR entry
+ * @param fire gate mask to OR the due slots into
+ * @param late_slots incremented for each slot after the first that was already overdue, i.e. missed its own interrupt
+ * @return the first slot left unfired; its time is the next compare value
+ */
+template<uint8_t CHANNEL_COUNT, uint8_t MASK_BYTES>
+inline uint8_t walk_schedule(const basic_schedule_t<CHANNEL_COUNT, MASK_BYTES> *schedule, uint8_t slot, uint16_t now, uint8_t *fire, uint16_t &late_slots) {
+  uint8_t first_slot = slot;
+  uint16_t window_end = now + MIN_INTERRUPT_COUNTS;
+  while(slot < schedule->slots && schedule->times[slot] <= window_end) {
+    if(slot != first_slot && schedule->times[slot] < now) {
+      late_slots++;
+    }
+    for(int b = 0; b < MASK_BYTES; b++) {
+      fire[b] |= schedule->masks[slot][b];
+    }
+    slot++;
+  }
+  return slot;
+}
+
+/**
+ * Zero-cross phase-locked loop arithmetic, see the PLL comment in src/main.cpp.  Periods are half-cycles in TCNT1 counts, held as 24.8 fixed
+ * point.
+ */
+const uint16_t PLL_MIN_PERIOD = 15000; // ~67Hz
+const uint16_t PLL_MAX_PERIOD = 22000; // ~45Hz
+const int16_t PLL_CAPTURE_COUNTS = 400; // accept edges within 200us of the prediction
+const uint8_t PLL_KP_SHIFT = 2; // correct 1/4 of the phase error each half-cycle
+const uint8_t PLL_KI_SHIFT = 5; // and fold 1/32 of it into the period
+const uint8_t PLL_LOCK_EDGES = 8; // consistent edges needed to lock
+const uint8_t PLL_COAST_CYCLES = 4; // half-cycles to flywheel through without an edge before unlocking
+
+/**
+ * @brief Phase error of an edge timestamped at now, while the counter wraps at top.
+ *
+ * @return positive if the edge came after the predicted wrap, negative if before it
+ */
+inline int16_t pll_phase_error(uint16_t now, uint16_t top) {
+  return now <= top / 2 ? (int16_t)now : (int16_t)(now - top - 1);
+}
+
+inline bool pll_in_capture(int16_t error) {
+  return error <= PLL_CAPTURE_COUNTS && error >= -PLL_CAPTURE_COUNTS;
+}
+
+/**
+ * @brief Open-loop acquisition: is a period measured from the last resync consistent enough to count towards lock?
+ */
+inline bool pll_acquire_edge(uint16_t measured, int32_t period_q8, uint8_t lock_count) {
+  if(measured < PLL_MIN_PERIOD || measured > PLL_MAX_PERIOD) {
+    return false;
+  }
+  return lock_count == 0 || pll_in_capture(measured - (int16_t)(period_q8 >> 8));
+}
+
+/**
+ * @brief Integral term: fold a fraction of the phase error into the period, within the supported mains range.
+ */
+inline int32_t pll_integrate(int32_t period_q8, int16_t error) {
+  period_q8 += (int32_t)error << (8 - PLL_KI_SHIFT);
+  if(period_q8 < ((int32_t)PLL_MIN_PERIOD << 8)) {
+    return (int32_t)PLL_MIN_PERIOD << 8;
+  }
+  if(period_q8 > ((int32_t)PLL_MAX_PERIOD << 8)) {
+    return (int32_t)PLL_MAX_PERIOD << 8;
+  }
+  return period_q8;
+}
+
+/**
+ * @brief Proportional term: TOP for the half-cycle in progress, stretched or shrunk to pull the phase in.
+ */
+inline uint16_t pll_top(int32_t period_q8, int16_t error) {
+  return (period_q8 >> 8) - 1 + error / (1 << PLL_KP_SHIFT);
+}
@@ -0,0 +1,22 @@
+/**
+ * @file dmx.h
+ * @brief DMX512 receiver on USART0, for builds with -DDMX_MODE.
+ *
+ * Takes over the USART receive interrupt from uart.h (250kbaud 8N2, a break shows up as a framing error), and copies a window of channels
+ * from each dimmer packet (start code 0) into the back half of a double buffer.  The halves swap once the window is complete, so the
+ * firmware always reads one whole packet's levels.  The ISR only copies bytes: turning them into a schedule means sorting, which is left to
+ * loop() so the firing ISR is never held off for long.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+
+const uint8_t DMX_MAX_CHANNELS = 24;
+const uint16_t DMX_UNIVERSE_SIZE = 512;
+
+extern volatile uint16_t dmx_packets; // complete windows received
+extern volatile uint16_t dmx_errors; // packets abandoned on an overrun, or ended by a break before the window was complete
+
+void dmx_begin(uint16_t start_address, uint8_t channels);
+bool dmx_read(uint8_t *levels);
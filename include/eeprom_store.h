@@ -0,0 +1,24 @@
+/**
+ * @file eeprom_store.h
+ * @brief Wear-levelled, CRC-checked record store in the EEPROM.
+ *
+ * The EEPROM is divided into fixed-size slots, each holding one copy of the record: 16-bit version, 16-bit sequence number, data, crc8 of
+ * all of it.  Saves go to the slot after the newest with the sequence number incremented, so writes rotate across the whole EEPROM, and a save
+ * torn by a power cut fails its CRC and leaves the previous copy as the newest valid one.  Writes are non-blocking: store_save() queues a
+ * copy and store_poll() starts one byte at a time as the EEPROM becomes ready (~3.4ms each), so loop() never stalls on them.
+ *
+ * The record's slots can be confined to the start of the EEPROM, leaving the rest for fixed-address blocks that the caller lays out itself;
+ * store_write_block() queues those through the same non-blocking writer.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+
+const uint8_t STORE_MAX_DATA = 96;
+
+bool store_begin(void *data, uint8_t size, uint16_t version, uint16_t eeprom_size);
+void store_save(const void *data);
+bool store_write_block(uint16_t address, const void *data, uint8_t size);
+bool store_busy();
+void store_poll();
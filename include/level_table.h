@@ -0,0 +1,104 @@
+/**
+ * @file level_table.h
+ * @brief Brightness level to firing delay lookup tables.
+ *
+ * Generated by tools/gen_level_table.py --earliest 45 --latest 85 --gamma 2.2; do not edit by hand.
+ *
+ * Entries are the firing delay as a fraction of the half-cycle (Q0.16); 0xffff means off.  Levels 1-255 run from LEVEL_TABLE_LATEST down
+ * to LEVEL_TABLE_EARLIEST.
+ * - level_table_linear: delivered power rises linearly with level
+ * - level_table_gamma: delivered power follows level^2.2, for perceptually even steps
+ *
+ * power_table is the fraction of full power (Q0.16) delivered to a resistive load when firing at delay i/POWER_TABLE_STEPS of the
+ * half-cycle, falling from 0xffff to 0.
+ */
+
+#pragma once
+
+#include <avr/pgmspace.h>
+
+const uint16_t LEVEL_TABLE_EARLIEST = 29491; // firing window the tables were generated for, Q0.16
+const uint16_t LEVEL_TABLE_LATEST = 55705;
+
+const uint16_t level_table_linear[256] PROGMEM = {
+  65535, 55705, 55355, 55025, 54714, 54418, 54136, 53865,
+  53606, 53356, 53115, 52882, 52656, 52436, 52223, 52016,
+  51814, 51617, 51425, 51236, 51052, 50872, 50695, 50522,
+  50352, 50185, 50021, 49860, 49701, 49545, 49391, 49240,
+  49090, 48943, 48798, 48655, 48513, 48374, 48236, 48099,
+  47965, 47832, 47700, 47570, 47441, 47313, 47187, 47062,
+  46938, 46816, 46694, 46574, 46455, 46336, 46219, 46103,
+  45988, 45873, 45760, 45647, 45535, 45425, 45314, 45205,
+  45097, 44989, 44882, 44776, 44670, 44565, 44461, 44357,
+  44254, 44152, 44050, 43949, 43848, 43748, 43649, 43550,
+  43452, 43354, 43256, 43159, 43063, 42967, 42872, 42777,
+  42682, 42588, 42495, 42401, 42308, 42216, 42124, 42032,
+  41941, 41850, 41760, 41670, 41580, 41490, 41401, 41312,
+  41224, 41136, 41048, 40961, 40873, 40786, 40700, 40614,
+  40527, 40442, 40356, 40271, 40186, 40101, 40017, 39933,
+  39849, 39765, 39681, 39598, 39515, 39432, 39350, 39267,
+  39185, 39103, 39021, 38940, 38858, 38777, 38696, 38615,
+  38535, 38454, 38374, 38294, 38214, 38134, 38054, 37975,
+  37896, 37816, 37737, 37658, 37580, 37501, 37423, 37344,
+  37266, 37188, 37110, 37032, 36955, 36877, 36800, 36722,
+  36645, 36568, 36491, 36414, 36337, 36260, 36184, 36107,
+  36031, 35954, 35878, 35802, 35726, 35650, 35574, 35498,
+  35422, 35346, 35270, 35195, 35119, 35044, 34968, 34893,
+  34818, 34743, 34667, 34592, 34517, 34442, 34367, 34292,
+  34217, 34142, 34067, 33992, 33918, 33843, 33768, 33693,
+  33619, 33544, 33469, 33395, 33320, 33246, 33171, 33096,
+  33022, 32947, 32873, 32798, 32724, 32649, 32574, 32500,
+  32425, 32351, 32276, 32202, 32127, 32052, 31978, 31903,
+  31828, 31754, 31679, 31604, 31529, 31454, 31379, 31305,
+  31230, 31155, 31080, 31005, 30929, 30854, 30779, 30704,
+  30628, 30553, 30478, 30402, 30327, 30251, 30175, 30100,
+  30024, 29948, 29872, 29796, 29720, 29643, 29567, 29491,
+};
+
+const uint16_t level_table_gamma[256] PROGMEM = {
+  65535, 55705, 55704, 55703, 55699, 55695, 55689, 55681,
+  55671, 55659, 55646, 55631, 55614, 55595, 55574, 55551,
+  55526, 55499, 55470, 55440, 55407, 55373, 55336, 55298,
+  55258, 55216, 55172, 55126, 55079, 55030, 54979, 54927,
+  54872, 54817, 54759, 54701, 54640, 54578, 54515, 54450,
+  54384, 54317, 54248, 54178, 54107, 54035, 53961, 53887,
+  53811, 53734, 53656, 53578, 53498, 53417, 53335, 53253,
+  53170, 53085, 53000, 52914, 52828, 52741, 52653, 52564,
+  52475, 52385, 52294, 52203, 52111, 52019, 51926, 51832,
+  51739, 51644, 51549, 51454, 51358, 51262, 51165, 51068,
+  50970, 50872, 50774, 50675, 50576, 50477, 50377, 50277,
+  50177, 50076, 49975, 49874, 49772, 49670, 49568, 49465,
+  49363, 49260, 49156, 49053, 48949, 48845, 48741, 48636,
+  48532, 48427, 48322, 48216, 48110, 48005, 47899, 47792,
+  47686, 47579, 47472, 47365, 47258, 47151, 47043, 46935,
+  46827, 46719, 46610, 46502, 46393, 46284, 46174, 46065,
+  45955, 45846, 45736, 45625, 45515, 45405, 45294, 45183,
+  45072, 44960, 44849, 44737, 44625, 44513, 44401, 44288,
+  44175, 44062, 43949, 43836, 43722, 43609, 43495, 43380,
+  43266, 43151, 43037, 42922, 42806, 42691, 42575, 42459,
+  42343, 42226, 42110, 41993, 41876, 41758, 41640, 41522,
+  41404, 41286, 41167, 41048, 40929, 40809, 40690, 40569,
+  40449, 40328, 40208, 40086, 39965, 39843, 39721, 39598,
+  39475, 39352, 39229, 39105, 38981, 38856, 38732, 38607,
+  38481, 38355, 38229, 38102, 37975, 37848, 37720, 37592,
+  37463, 37334, 37205, 37075, 36945, 36814, 36683, 36551,
+  36419, 36286, 36153, 36020, 35886, 35751, 35616, 35481,
+  35345, 35208, 35071, 34933, 34795, 34656, 34516, 34376,
+  34236, 34094, 33952, 33810, 33666, 33522, 33378, 33233,
+  33087, 32940, 32792, 32644, 32495, 32345, 32194, 32043,
+  31891, 31737, 31583, 31428, 31273, 31116, 30958, 30799,
+  30639, 30479, 30317, 30154, 29990, 29825, 29658, 29491,
+};
+
+const uint8_t POWER_TABLE_STEPS = 64;
+const uint16_t power_table[65] PROGMEM = {
+  65535, 65533, 65522, 65491, 65431, 65332, 65186, 64984,
+  64718, 64382, 63968, 63470, 62883, 62204, 61429, 60555,
+  59581, 58507, 57333, 56060, 54692, 53230, 51680, 50046,
+  48335, 46552, 44706, 42804, 40855, 38867, 36850, 34814,
+  32768, 30721, 28685, 26668, 24680, 22731, 20829, 18983,
+  17200, 15489, 13855, 12305, 10843,  9475,  8202,  7028,
+   5954,  4980,  4106,  3331,  2652,  2065,  1567,  1153,
+    817,   551,   349,   203,   104,    44,    13,     2,
+      0,
+};
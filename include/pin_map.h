@@ -0,0 +1,56 @@
+/**
+ * @file pin_map.h
+ * @brief Compile-time Arduino nano pin to port mapping, so gate outputs fold to constant port masks.
+ *
+ * The ATmega328P's digital header is fixed: D0-D7 are PORTD bits 0-7, D8-D13 PORTB bits 0-5 and A0-A5 (D14-D19) PORTC bits 0-5.  Resolving
+ * a pin map here rather than through digitalPinToPort() lets every port's gate mask become an immediate, so releasing the gates is an
+ * andi/out (or a single cbi) per port and a port with no gates on it is never touched at all.  Everything is C++11 constexpr (one return
+ * statement each), and host-compilable like dimmer_core.h.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// gate mask byte of each port, in the order output_fire() takes them
+enum gate_port_t { GATE_PORTB, GATE_PORTC, GATE_PORTD, GATE_PORT_NONE };
+
+constexpr uint8_t pin_port(int pin) {
+  return pin < 0 ? GATE_PORT_NONE : pin < 8 ? GATE_PORTD : pin < 14 ? GATE_PORTB : pin < 20 ? GATE_PORTC : GATE_PORT_NONE;
+}
+
+constexpr uint8_t pin_bit(int pin) {
+  return pin < 0 ? 0 : pin < 8 ? 1 << pin : pin < 14 ? 1 << (pin - 8) : pin < 20 ? 1 << (pin - 14) : 0;
+}
+
+/**
+ * @brief Gate mask of one pin for one port: its bit if the pin is on that port, otherwise 0.
+ */
+constexpr uint8_t pin_mask(int pin, uint8_t port) {
+  return pin_port(pin) == port ? pin_bit(pin) : 0;
+}
+
+/**
+ * @brief OR of the masks of pins[from] onwards on one port.
+ */
+template<size_t N>
+constexpr uint8_t port_mask(const int (&pins)[N], uint8_t port, size_t from = 0) {
+  return from == N ? 0 : pin_mask(pins[from], port) | port_mask(pins, port, from + 1);
+}
+
+/**
+ * @brief Is every pin from pins[from] onwards on the header?
+ */
+template<size_t N>
+constexpr bool pins_mapped(const int (&pins)[N], size_t from = 0) {
+  return from == N || (pin_port(pins[from]) != GATE_PORT_NONE && pins_mapped(pins, from + 1));
+}
+
+/**
+ * @brief Does any pin from pins[from] onwards appear twice?
+ */
+template<size_t N>
+constexpr bool pins_unique(const int (&pins)[N], size_t from = 0) {
+  return from == N || ((port_mask(pins, pin_port(pins[from]), from + 1) & pin_bit(pins[from])) == 0 && pins_unique(pins, from + 1));
+}
@@ -0,0 +1,28 @@
+/**
+ * @file uart.h
+ * @brief Interrupt-driven USART0 driver with RX and TX ring buffers.
+ *
+ * Replaces HardwareSerial so the firmware owns the USART interrupts: received bytes are queued by ISR(USART_RX_vect) into a 256 byte ring and
+ * consumed by the frame parser from loop(), and transmission drains from ISR(USART_UDRE_vect) so writers only wait when the TX ring is full.
+ * Don't reference Serial anywhere in the build, or its ISRs will collide with these.
+ *
+ * After uart_rs485() the driver also drives a half-duplex transceiver's driver enable: high from the first queued byte until the last has
+ * left the shift register (ISR(USART_TX_vect)), low (receiving) otherwise.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+
+const uint16_t UART_RX_BUFFER_SIZE = 256; // indexed by uint8_t, so it wraps for free
+const uint8_t UART_TX_BUFFER_SIZE = 64; // power of two
+
+extern volatile uint16_t uart_rx_overruns; // bytes dropped because the RX ring was full
+
+void uart_begin(unsigned long baud);
+void uart_rs485(uint8_t de_pin);
+uint8_t uart_available();
+uint8_t uart_read();
+void uart_write(uint8_t byte);
+void uart_write(const uint8_t *data, uint8_t length);
+void uart_flush();
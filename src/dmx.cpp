@@ -0,0 +1,98 @@
+/**
+ * @file dmx.cpp
+ * @brief DMX512 receiver, see dmx.h.
+ */
+
+#include "dmx.h"
+
+#ifdef DMX_MODE
+
+uint8_t dmx_levels[2][DMX_MAX_CHANNELS];
+volatile uint8_t dmx_front = 0; // the half dmx_read() copies from; the ISR fills the other
+volatile bool dmx_fresh = false; // dmx_front has swapped since the last dmx_read()
+volatile uint16_t dmx_packets = 0;
+volatile uint16_t dmx_errors = 0;
+
+uint16_t dmx_slot = DMX_UNIVERSE_SIZE + 1; // next slot expected, 0 being the start code; past the end while waiting for a break
+uint16_t dmx_first_slot = 1;
+uint8_t dmx_channels = 0;
+
+/**
+ * @brief Start receiving.
+ *
+ * @param start_address DMX address of the first channel, 1-512
+ * @param channels number of consecutive slots to take, up to DMX_MAX_CHANNELS
+ */
+void dmx_begin(uint16_t start_address, uint8_t channels) {
+  dmx_first_slot = start_address;
+  dmx_channels = channels < DMX_MAX_CHANNELS ? channels : DMX_MAX_CHANNELS;
+  UCSR0A = 0;
+  UBRR0 = F_CPU / 16 / 250000 - 1;
+  UCSR0C = (1 << USBS0) | (1 << UCSZ01) | (1 << UCSZ00); // 8N2
+  UCSR0B = (1 << RXEN0) | (1 << RXCIE0);
+}
+
+/**
+ * ~40 cycles per slot, well inside the 44us a slot takes at 250kbaud, so a full 512 slot refresh at 44Hz costs the firing ISR at most one
+ * short hold-off per byte.
+ */
+ISR(USART_RX_vect) {
+  uint8_t status = UCSR0A; // must be read before UDR0
+  uint8_t byte = UDR0;
+  if(status & (1 << FE0)) {
+    // break: the next byte is a start code
+    if(dmx_slot > dmx_first_slot && dmx_slot < dmx_first_slot + dmx_channels) {
+      dmx_errors++;
+    }
+    dmx_slot = 0;
+    return;
+  }
+  if(status & (1 << DOR0)) {
+    dmx_errors++;
+    dmx_slot = DMX_UNIVERSE_SIZE + 1;
+    return;
+  }
+  uint16_t slot = dmx_slot;
+  if(slot > DMX_UNIVERSE_SIZE) {
+    return;
+  }
+  dmx_slot = slot + 1;
+  if(slot == 0) {
+    if(byte != 0) {
+      dmx_slot = DMX_UNIVERSE_SIZE + 1; // not dimmer data (RDM, text...): skip to the next break
+    }
+    return;
+  }
+  uint16_t index = slot - dmx_first_slot;
+  if(index < dmx_channels) {
+    uint8_t back = dmx_front ^ 1;
+    dmx_levels[back][index] = byte;
+    if(index == dmx_channels - 1) {
+      dmx_front = back;
+      dmx_fresh = true;
+      dmx_packets++;
+    }
+  }
+}
+
+/**
+ * @brief Copy the latest complete window of levels, if a new one has arrived since the last call.
+ *
+ * @param levels the channels passed to dmx_begin(), 0-255 each
+ * @return true if levels was filled
+ */
+bool dmx_read(uint8_t *levels) {
+  noInterrupts();
+  bool fresh = dmx_fresh;
+  if(fresh) {
+    dmx_fresh = false;
+    const uint8_t *front = dmx_levels[dmx_front];
+    for(uint8_t i = 0; i < dmx_channels; i++) {
+      levels[i] = front[i];
+    }
+  }
+  interrupts();
+  return fresh;
+}
+
+#endif
@@ -0,0 +1,150 @@
+/**
+ * @file eeprom_store.cpp
+ * @brief Wear-levelled EEPROM record store, see eeprom_store.h.
+ */
+
+#include "eeprom_store.h"
+
+#include <avr/eeprom.h>
+
+#include "crc8.h"
+
+const uint8_t STORE_HEADER = 4; // version, sequence
+
+uint8_t store_size = 0; // whole slot: header, data, crc
+uint16_t store_version = 0;
+uint8_t store_slots = 0;
+uint8_t store_newest = 0; // slot of the newest valid record, or of the save in progress
+uint16_t store_sequence = 0; // its sequence number
+
+uint8_t store_buffer[STORE_HEADER + STORE_MAX_DATA + 1]; // the slot being written
+uint8_t store_written = 0; // bytes of store_buffer written so far
+bool store_pending = false;
+
+uint8_t block_buffer[STORE_MAX_DATA]; // a store_write_block() in progress
+uint16_t block_address;
+uint8_t block_size = 0;
+uint8_t block_written = 0;
+bool block_pending = false;
+
+static uint8_t *slot_address(uint8_t slot) {
+  return (uint8_t *)(uintptr_t)((uint16_t)slot * store_size);
+}
+
+/**
+ * @brief Find the newest valid copy of the record and load it.
+ *
+ * @param data filled with the record if one was found, left alone otherwise
+ * @param size record size, up to STORE_MAX_DATA; fixed for the life of the EEPROM layout, so change version when it changes
+ * @param version records with any other version are ignored
+ * @param eeprom_size bytes from address 0 to rotate the record across, E2END + 1 for the whole EEPROM
+ * @return true if data was loaded
+ */
+bool store_begin(void *data, uint8_t size, uint16_t version, uint16_t eeprom_size) {
+  store_size = STORE_HEADER + size + 1;
+  store_version = version;
+  store_slots = eeprom_size / store_size;
+  bool found = false;
+  for(uint8_t slot = 0; slot < store_slots; slot++) {
+    uint8_t *address = slot_address(slot);
+    uint8_t crc = 0;
+    for(uint8_t i = 0; i < store_size - 1; i++) {
+      crc = crc8_update(crc, eeprom_read_byte(address + i));
+    }
+    if(crc != eeprom_read_byte(address + store_size - 1) || eeprom_read_word((const uint16_t *)address) != version) {
+      continue;
+    }
+    uint16_t sequence = eeprom_read_word((const uint16_t *)(address + 2));
+    // newer by serial number arithmetic, so the sequence can wrap
+    if(!found || (int16_t)(sequence - store_sequence) > 0) {
+      found = true;
+      store_newest = slot;
+      store_sequence = sequence;
+    }
+  }
+  if(found) {
+    eeprom_read_block(data, slot_address(store_newest) + STORE_HEADER, size);
+  } else {
+    store_newest = store_slots - 1; // so the first save lands in slot 0
+  }
+  return found;
+}
+
+/**
+ * @brief Queue a copy of the record for writing, replacing any save still in progress.
+ *
+ * A replaced save restarts in the same slot, so the newest complete copy is never overwritten.
+ */
+void store_save(const void *data) {
+  if(!store_pending) {
+    store_newest = (store_newest + 1) % store_slots;
+    store_sequence++;
+  }
+  store_buffer[0] = store_version & 0xff;
+  store_buffer[1] = store_version >> 8;
+  store_buffer[2] = store_sequence & 0xff;
+  store_buffer[3] = store_sequence >> 8;
+  memcpy(store_buffer + STORE_HEADER, data, store_size - STORE_HEADER - 1);
+  uint8_t crc = 0;
+  for(uint8_t i = 0; i < store_size - 1; i++) {
+    crc = crc8_update(crc, store_buffer[i]);
+  }
+  store_buffer[store_size - 1] = crc;
+  store_written = 0;
+  store_pending = true;
+}
+
+/**
+ * @brief Queue a copy of a block for writing at a fixed address, outside the record's slots.
+ *
+ * Unlike the record there is no rotation and no CRC; a block torn by a power cut is the caller's to detect.  Written after any record save
+ * in progress.
+ *
+ * @param size up to STORE_MAX_DATA
+ * @return false, and nothing queued, if an earlier block is still being written
+ */
+bool store_write_block(uint16_t address, const void *data, uint8_t size) {
+  if(block_pending || size > STORE_MAX_DATA) {
+    return false;
+  }
+  memcpy(block_buffer, data, size);
+  block_address = address;
+  block_size = size;
+  block_written = 0;
+  block_pending = size > 0;
+  return true;
+}
+
+bool store_busy() {
+  return store_pending || block_pending;
+}
+
+/**
+ * @brief Start writing the next byte of a queued save or block, if the EEPROM is ready.  Call from every loop() pass while store_busy().
+ *
+ * Bytes that already hold the right value are skipped without a write cycle.
+ */
+void store_poll() {
+  while(store_pending && eeprom_is_ready()) {
+    uint8_t *address = slot_address(store_newest) + store_written;
+    uint8_t value = store_buffer[store_written];
+    if(++store_written == store_size) {
+      store_pending = false;
+    }
+    if(eeprom_read_byte(address) != value) {
+      eeprom_write_byte(address, value);
+      return;
+    }
+  }
+  while(!store_pending && block_pending && eeprom_is_ready()) {
+    uint8_t *address = (uint8_t *)(uintptr_t)(block_address + block_written);
+    uint8_t value = block_buffer[block_written];
+    if(++block_written == block_size) {
+      block_pending = false;
+    }
+    if(eeprom_read_byte(address) != value) {
+      eeprom_write_byte(address, value);
+      return;
+    }
+  }
+}
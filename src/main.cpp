@@ -4,263 +4,2386 @@
  * 
  * Loosely based on the code from https://www.instructables.com/id/Arduino-controlled-light-dimmer-The-circuit/ but retargeted for the ATmega328P/arduino nano.
  * 
- * The code uses TimerOne library to generate interrupts at a specific frequency to control the firing angle of the triac.
- * It listens for serial commands to adjust the delay time, light intensity, and turn off the light.
+ * Timer1 counts each mains half-cycle and fires the triacs from compare matches against a precomputed schedule.  Boards without a free 16-bit
+ * timer can build with -DPOLLING_FALLBACK instead, which polls the firing angles from a Timer2 tick (see the polling fallback comment).
+ * It listens for binary framed serial commands to set channel levels, pick an effect and adjust the calibration.
  * The dimming effect is achieved by gradually changing the light intensity from high to low and vice versa.
  * 
  * Pin Assignments:
- * - Pin 3 to Pin 10: Connected to the triac control pins for each channel
+ * - Pin 3 to Pin 10: Connected to the triac control pins for each channel (PIN_ASSIGNMENTS; with -DOUTPUT_SHIFT_REGISTER the gates are a
+ *   74HC595 chain on D10 (latch), D11 (data) and D13 (clock) instead, for up to 24 CHANNELS)
  * - Pin 2: Connected to the zero-crossing detection pin - this is one of the interrupt pins, I wasted an hour trying to figure out why it wasn't working using another pin
  * - Pin 13: Connected to an LED for visual indication and debugging
  * 
  * Constants:
- * - CHANNEL_SELECT: Current channel being controlled
- * - clock_tick: Variable for Timer1 interrupt
- * - delay_time: Delay time between each change in light intensity
- * - delay_time2: Delay time for serial commands
- * - low: Maximum light intensity
- * - high: Minimum light intensity
- * - off: Fully off light intensity
+ * - delay_time: Interval between telemetry frames, 0 (the default) sends them only on request
  * - SYNC_PIN: Pin for firing angle control
  * - led: Pin for LED indication
+ * - PIN_ASSIGNMENTS: Each channel's gate pin, resolved to constant port masks at compile time (pin_map.h); the board envs in platformio.ini
+ *   set it
  * 
  * Functions:
- * - timerIsr(): Interrupt service routine for Timer1 interrupt
- * - zero_cross_int(): Function to be fired at the zero crossing to dim the light
- * - setup(): Setup function to initialize pins and attach interrupts
- * - set_lux(int i): Function to set the light intensity
- * - serialEvent(): Function to listen for serial commands
- * - loop(): Main loop function to control the dimming effect
- */
-
-#include <TimerOne.h>
-
-const int pin_assignments[] = {9, 8, 7, 6, 5, 4, 3, 10};
-int lux[8];
-unsigned char CHANNEL_SELECT;
-unsigned char i = 0;
-unsigned char clock_tick; // variable for Timer1
-unsigned int delay_time = 100;
-unsigned int delay_time2 = 100;
-unsigned char low = 85; // luce massima
-unsigned char high = 45; // luce minima
-unsigned char off = 95; // totalmente accesa
-int SYNC_PIN = 2; // for firing angle control
-int led = 13;
-
-// // command: top 13 bits are the lux value, bottom 3 bits are the channel; 0 means finished
-uint16_t commands[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+ * - ISR(TIMER1_COMPA_vect): Compare-match firing engine, writes the gate ports or shift registers directly from precomputed per-slot masks
+ * - ISR(TIMER1_COMPB_vect): Releases the triac gates gate_pulse_counts after each firing
+ * - ISR(TIMER1_CAPT_vect): Starts each half-cycle when Timer1 wraps at the PLL's predicted zero cross
+ * - zero_cross_int(): Function to be fired at the zero crossing, corrects the PLL's period and phase
+ * - ISR(ADC_vect): With -DMAINS_COMPENSATION, samples the mains sense for the brightness correction (see update_mains_gain())
+ * - ISR(TIMER2_COMPA_vect): With -DPOLLING_FALLBACK, fires the channels from a 100us tick instead of the three Timer1 ISRs
+ * - setup(): Setup function to initialize pins and attach interrupts, and load node_id for bus mode
+ * - parse_byte(): Binary framed control protocol, see the comment above FRAME_SYNC
+ * - process_serial(): Feeds bytes queued by the uart.h RX interrupt to the parser
+ * - fade_step(): Per-channel fades to a target level, started by OP_FADE
+ * - dmx_step(): With -DDMX_MODE, sets the channels from the DMX512 packets received by dmx.h instead
+ * - run_tasks(): Cooperative scheduler; loop() just calls it
+ * - config_task(): Saves calibration and the last scene to EEPROM (config_t), restored by load_config() in setup()
+ * - supervisor_task(): Feeds the watchdog while the ISRs and loop() are both alive, and fades to the safe scene if the host goes quiet
+ * - recall_scene(): Switches to a scene from the EEPROM scene table at the next zero cross, started by OP_RECALL_SCENE
+ * - loop(): Runs the tasks, then sleeps until the next interrupt (idle_sleep())
+ */
+
+#include <avr/eeprom.h>
+#include <avr/sleep.h>
+#include <avr/wdt.h>
+#include "crc8.h"
+#include "dimmer_core.h"
+#include "dmx.h"
+#include "eeprom_store.h"
+#include "level_table.h"
+#include "pin_map.h"
+#include "uart.h"
+
+// build_flags = -DLEVEL_CURVE_LINEAR selects equal power steps instead of the perceptual (gamma 2.2) curve
+#ifdef LEVEL_CURVE_LINEAR
+#define LEVEL_TABLE level_table_linear
+#else
+#define LEVEL_TABLE level_table_gamma
+#endif
+
+// build_flags = -DCHANNELS=16 (up to 24) for more than one Krida board's worth of channels
+#ifndef CHANNELS
+#define CHANNELS 8
+#endif
+static_assert(CHANNELS >= 1 && CHANNELS <= 24, "CHANNELS must be 1-24");
+
+/**
+ * Gate outputs.  By default each channel is a port pin from PIN_ASSIGNMENTS, and a gate mask is one byte per port (PORTB, PORTC, PORTD)
+ * written directly.  With -DOUTPUT_SHIFT_REGISTER the gates are a chain of latched 74HC595s on the SPI pins (MOSI D11, SCK D13, latch D10),
+ * channel 0 on the first register's Q0, and a gate mask is one byte per register clocked out and latched at once.  Either way every channel
+ * due in a slot changes in one operation.
+ */
+const int SYNC_PIN = 2; // for firing angle control
+const int led = 13;
+
+#ifdef OUTPUT_SHIFT_REGISTER
+const uint8_t GATE_MASK_BYTES = (CHANNELS + 7) / 8;
+const int SHIFT_LATCH_PIN = 10;
+const uint8_t LED_PORTB_MASK = 0; // the LED shares D13 with SCK, so it is left alone
+#else
+const uint8_t GATE_MASK_BYTES = 3;
+
+// the Krida 8ch wiring; other boards set it from their env in platformio.ini, e.g. -DPIN_ASSIGNMENTS="{9,8,7,6,5,4,3,10,11,12,14,15,16,17,18,19}"
+#ifndef PIN_ASSIGNMENTS
+#define PIN_ASSIGNMENTS {9, 8, 7, 6, 5, 4, 3, 10}
+#endif
+constexpr int pin_assignments[] = PIN_ASSIGNMENTS;
+static_assert(sizeof(pin_assignments) / sizeof(pin_assignments[0]) == CHANNELS, "PIN_ASSIGNMENTS needs one pin per channel");
+static_assert(pins_mapped(pin_assignments), "PIN_ASSIGNMENTS must be D0-D19 (A0-A5 are 14-19)");
+static_assert(pins_unique(pin_assignments), "PIN_ASSIGNMENTS has a pin twice");
+
+// every gate on each port, as immediates: see pin_map.h
+const uint8_t GATE_MASK_PORTB = port_mask(pin_assignments, GATE_PORTB);
+const uint8_t GATE_MASK_PORTC = port_mask(pin_assignments, GATE_PORTC);
+const uint8_t GATE_MASK_PORTD = port_mask(pin_assignments, GATE_PORTD);
+const uint8_t LED_PORTB_MASK = pin_mask(led, GATE_PORTB);
+static_assert((GATE_MASK_PORTD & (pin_bit(0) | pin_bit(1) | pin_bit(SYNC_PIN))) == 0, "PIN_ASSIGNMENTS uses the UART or zero-cross pin");
+static_assert((GATE_MASK_PORTB & LED_PORTB_MASK) == 0, "PIN_ASSIGNMENTS uses the LED pin");
+#endif
+
+// bus mode (see the protocol comment): RS-485 driver enable, and this node's address on the bus
+#ifndef BUS_DE_PIN
+#define BUS_DE_PIN 12
+#endif
+#if defined(BUS_MODE) && defined(OUTPUT_SHIFT_REGISTER) && BUS_DE_PIN == 12
+#error "D12 is MISO, an input while SPI drives the shift registers: set BUS_DE_PIN to a free pin"
+#endif
+#if defined(BUS_MODE) && !defined(OUTPUT_SHIFT_REGISTER)
+static_assert((port_mask(pin_assignments, pin_port(BUS_DE_PIN)) & pin_bit(BUS_DE_PIN)) == 0, "PIN_ASSIGNMENTS uses BUS_DE_PIN");
+#endif
+const uint8_t BUS_BROADCAST = 0xff; // address of every node, and the node_id of one that hasn't been given one
+uint8_t node_id = BUS_BROADCAST; // persisted, see config_t
+
+// DMX mode: the UART receives DMX512 instead of the control protocol, channel 0 at DMX_START_ADDRESS
+#ifndef DMX_START_ADDRESS
+#define DMX_START_ADDRESS 1
+#endif
+#ifdef DMX_MODE
+#ifdef BUS_MODE
+#error "DMX_MODE and BUS_MODE both need the UART"
+#endif
+static_assert(DMX_START_ADDRESS >= 1 && DMX_START_ADDRESS + CHANNELS - 1 <= DMX_UNIVERSE_SIZE, "channels must fit in the DMX universe");
+#endif
+static_assert(CHANNELS <= DMX_MAX_CHANNELS, "dmx.h needs a bigger buffer");
+// persisted, so the build flag is only the default.  A DMX build has no control protocol to change it with: flash a serial build with the
+// same CHANNELS, send CONFIG_DMX_ADDRESS, then flash the DMX build, which loads the saved address as config_t's layout is the same in both.
+uint16_t dmx_start_address = DMX_START_ADDRESS;
+
+const uint8_t CHANNEL_MASK_BYTES = (CHANNELS + 7) / 8; // a bit per channel, channel 0 in bit 0 of the first byte
 
+typedef basic_schedule_t<CHANNELS, GATE_MASK_BYTES> schedule_t;
+typedef basic_command_list_t<CHANNELS> command_list_t;
+
+unsigned int delay_time = 0; // telemetry interval in ms, 0 for none
+
+/**
+ * Double-buffered schedule.  The ISRs only ever read schedules[active_schedule]; loop() builds the other one and publishes it by setting
+ * schedule_pending, and zero_cross_int() flips active_schedule at the next half-cycle boundary.  Both flags are single bytes, so every access is
+ * atomic and neither side takes a lock.  loop() clears schedule_pending before touching the back buffer, which stops the flip while it writes.
+ */
+schedule_t schedules[2];
+volatile uint8_t active_schedule = 0;
+volatile bool schedule_pending = false;
+const schedule_t *firing_schedule = &schedules[0]; // owned by the ISRs: latched at each zero cross
+
+// Levels are in percent of the measured half-cycle, so 1% is:
 // 50Hz => 100us
 // 60Hz => 83.33us
+const uint16_t HALF_PERIOD_50HZ = 20000; // half-cycle in TCNT1 counts (0.5us each with the /8 prescaler)
+const uint16_t HALF_PERIOD_60HZ = 16667;
+
+volatile uint16_t measured_half_period = 0; // published by the PLL once locked, 0 until then
+uint16_t half_period = HALF_PERIOD_50HZ; // loop()'s copy, used to scale levels to counts
+const uint16_t FIRING_CUTOFF = 0xf333; // Q0.16 of the half-cycle: 95%, the latest anything is scheduled, clear of the next zero cross
+uint8_t mains_hz = 50;
+
+// triac gate pulse width in TCNT1 counts, released by the OCR1B compare
+const uint8_t GATE_PULSE_COUNTS_50HZ = 10; // 5us
+const uint8_t GATE_PULSE_COUNTS_60HZ = 17; // 8.33us
+uint8_t gate_pulse_counts = GATE_PULSE_COUNTS_60HZ; // the longer pulse until the frequency is known
+
+// Gate masks for each channel, filled in once in setup() for build_schedule() to merge into slots
+uint8_t channel_masks[CHANNELS][GATE_MASK_BYTES];
+
+#ifdef OUTPUT_SHIFT_REGISTER
+
+/**
+ * @brief Clock a gate mask into the 595 chain, last register first, then latch every output at once.
+ *
+ * SPI runs at 8MHz, so each register costs ~20 cycles.
+ */
+inline void shift_out_gates(const uint8_t *mask) {
+  for(int b = GATE_MASK_BYTES - 1; b >= 0; b--) {
+    SPDR = mask[b];
+    while(!(SPSR & (1 << SPIF))) {
+    }
+  }
+  PORTB |= (1 << 2); // latch on D10 (PB2)
+  PORTB &= ~(1 << 2);
+}
+
+inline void output_fire(const uint8_t *fire) {
+  shift_out_gates(fire);
+}
+
+inline void output_release() {
+  static const uint8_t none[GATE_MASK_BYTES] = {0};
+  shift_out_gates(none);
+}
+
+/**
+ * @brief Set up the SPI master for the 595 chain, with channel n on bit n%8 of register n/8.
+ */
+void initialize_outputs() {
+  pinMode(SHIFT_LATCH_PIN, OUTPUT); // also SS, which must be an output to stay SPI master
+  pinMode(11, OUTPUT); // MOSI
+  pinMode(13, OUTPUT); // SCK
+  SPCR = (1 << SPE) | (1 << MSTR);
+  SPSR = (1 << SPI2X); // fosc/2
+  for(int i = 0; i < CHANNELS; i++) {
+    for(int b = 0; b < GATE_MASK_BYTES; b++) {
+      channel_masks[i][b] = b == i / 8 ? 1 << (i % 8) : 0;
+    }
+  }
+  output_release();
+}
+
+#else
+
+/**
+ * @brief Raise the gates in a mask: one in/or/out per port that has gates, and nothing at all for a port that has none.
+ */
+inline void output_fire(const uint8_t *fire) {
+  if(GATE_MASK_PORTB) {
+    PORTB |= fire[GATE_PORTB];
+  }
+  if(GATE_MASK_PORTC) {
+    PORTC |= fire[GATE_PORTC];
+  }
+  if(GATE_MASK_PORTD) {
+    PORTD |= fire[GATE_PORTD];
+  }
+}
+
+/**
+ * @brief Drop every gate.  The masks are immediates, so this is an andi/out per port with gates, or a single cbi where it has one.
+ */
+inline void output_release() {
+  if(GATE_MASK_PORTB) {
+    PORTB &= ~GATE_MASK_PORTB;
+  }
+  if(GATE_MASK_PORTC) {
+    PORTC &= ~GATE_MASK_PORTC;
+  }
+  if(GATE_MASK_PORTD) {
+    PORTD &= ~GATE_MASK_PORTD;
+  }
+}
+
+/**
+ * @brief Set the gate pins as outputs and fill in channel_masks[] from pin_assignments[], both resolved at compile time.
+ */
+void initialize_outputs() {
+  for(int i = 0; i < CHANNELS; i++) {
+    pinMode(pin_assignments[i], OUTPUT);
+    channel_masks[i][GATE_PORTB] = pin_mask(pin_assignments[i], GATE_PORTB);
+    channel_masks[i][GATE_PORTC] = pin_mask(pin_assignments[i], GATE_PORTC);
+    channel_masks[i][GATE_PORTD] = pin_mask(pin_assignments[i], GATE_PORTD);
+  }
+  pinMode(led, OUTPUT);
+}
+
+#endif
+
+#ifdef POLLING_FALLBACK
+
+/**
+ * Polling fallback, for boards without a free 16-bit timer (-DPOLLING_FALLBACK).
+ *
+ * Timer2 interrupts every POLL_TICK_COUNTS and ISR(TIMER2_COMPA_vect) fires each channel on the one tick its firing tick falls due since
+ * the last zero-cross edge, then releases it on the next, so every gate pulse is one tick wide.  Nothing fires in the last
+ * POLL_CUTOFF_DIVISOR'th of the half period, so no pulse straddles the crossing and latches the triac on into the next half-cycle.  There
+ * is no PLL and no compare schedule: each edge simply restarts the count, so timing is only as clean as the zero-cross signal and
+ * resolution is one tick (1% of a 50Hz half-cycle).  Timer1 is left free.
+ */
+const uint8_t POLL_TICK_COUNTS = 200; // 100us, in the same 0.5us counts as TCNT1 (Timer2 also runs at /8)
+const uint8_t POLL_MAX_TICKS = PLL_MAX_PERIOD / POLL_TICK_COUNTS; // firing stops this long after the last edge: loss of sync
+const uint8_t POLL_OFF_TICK = 0xff; // never reached
+const uint8_t BURST_PULSE_TICKS = 4; // BURST_PULSE_COUNTS, rounded to ticks
+const uint8_t POLL_CUTOFF_DIVISOR = 20; // no channel fires in the last 1/20 of the half period, the old 95% off point
+
+uint8_t lux[CHANNELS]; // each channel's firing tick, written by update_schedule()
+volatile uint8_t clock_tick = POLL_MAX_TICKS; // ticks since the last edge, saturating at POLL_MAX_TICKS
+uint8_t poll_sync_ticks = POLL_MAX_TICKS; // ISR only: nothing fires this long after the last edge, a half period and 200us
+uint8_t poll_cutoff_ticks = HALF_PERIOD_60HZ / POLL_TICK_COUNTS * (POLL_CUTOFF_DIVISOR - 1) / POLL_CUTOFF_DIVISOR; // ISR only, until measured
+
+#endif
+
+uint8_t next_slot = 0;
+
+/**
+ * Firing ISR instrumentation, all in TCNT1 counts (0.5us).  Written only by the ISRs; read and reset by loop() with interrupts off, see
+ * read_isr_stats().
+ */
+struct isr_stats_t {
+  uint16_t fires; // compare interrupts taken, saturating
+  uint16_t lateness_min; // TCNT1 at ISR entry minus the OCR1A it was armed for
+  uint16_t lateness_max;
+  uint32_t lateness_sum; // of the interrupts counted in fires, so the mean stays valid once it saturates
+  uint16_t late_slots; // slots that were already overdue when a walk reached them, i.e. missed their own interrupt
+  uint16_t missed_slots; // slots still unfired when the next half-cycle started
+  uint16_t rejected_edges; // zero-cross edges ignored as noise
+  uint16_t half_cycles;
+  uint16_t masked_glitches; // edge windows that opened on an edge latched while INT0 was masked
+  uint16_t coasted_edges; // edge windows that closed without a crossing
+  uint16_t sync_losses; // times the PLL gave up coasting and dropped the gates, see the supervisor comment
+};
+
+isr_stats_t isr_stats = {0, 0xffff, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+volatile bool isr_heartbeat = false; // set by the timer ISRs, taken by supervisor_task()
+bool sync_lost = false; // ISR only: lock was lost and no crossing has been taken since, so nothing is firing
+
+#ifndef POLLING_FALLBACK
+
+/**
+ * @brief Drop every gate and cancel a pending OCR1B release, for when TCNT1 is about to be reset under it.
+ */
+void release_gates() {
+  TIMSK1 &= ~(1 << OCIE1B);
+  output_release();
+}
+
+/**
+ * Zero-cross edge window.
+ *
+ * Once the PLL is locked, INT0 is masked except for PLL_CAPTURE_COUNTS either side of the predicted crossing, and masked again as soon as
+ * the crossing has been taken, so noise and contact bounce outside the window never reach zero_cross_int() at all.  The window opens and
+ * closes on OCR1A, interleaved with the firing slots by arm_compare().  An edge latched in INTF0 while masked is counted as a glitch and
+ * discarded when the window opens; a window that closes empty counts as a coasted edge, and the PLL flywheels through that half-cycle on
+ * its period estimate as before.  While unlocked INT0 is always open.
+ */
+uint16_t edge_event = 0xffff; // TCNT1 at which the window next opens or closes, 0xffff for none
+bool edge_window_open = true;
+
+inline void arm_compare(uint16_t slot_time) {
+  OCR1A = slot_time < edge_event ? slot_time : edge_event;
+}
+
+void open_edge_window() {
+  if(EIFR & (1 << INTF0)) {
+    isr_stats.masked_glitches++;
+  }
+  EIFR = (1 << INTF0); // forget anything that arrived while masked
+  EIMSK |= (1 << INT0);
+  edge_window_open = true;
+  edge_event = 0xffff; // start_half_cycle() schedules the close
+}
+
+void close_edge_window() {
+  EIMSK &= ~(1 << INT0);
+  edge_window_open = false;
+}
+
+/**
+ * @brief Schedule the window around the crossing at the current TOP, or open it now if that is already too close.
+ */
+void schedule_edge_window() {
+  uint16_t open_at = ICR1 - PLL_CAPTURE_COUNTS;
+  if(open_at <= (uint16_t)(TCNT1 + 16)) {
+    open_edge_window();
+  } else {
+    edge_event = open_at;
+  }
+}
+
+/**
+ * @brief OCR1A reached edge_event.
+ */
+void edge_window_event() {
+  if(edge_window_open) {
+    close_edge_window();
+    isr_stats.coasted_edges++;
+    schedule_edge_window();
+  } else {
+    open_edge_window();
+  }
+}
+
+/**
+ * @brief Compare-match interrupt: fire every channel due in this slot.
+ *
+ * All slots due within the next MIN_INTERRUPT_COUNTS are folded into one gate mask, so channels sharing a firing angle switch on with a
+ * single write per port (or one latch of the shift register chain) instead of one digitalWrite() (~4us each) per channel.
+ *
+ * Coincident channels are normally merged into one slot by update_schedule(); the walk only takes more than one slot when the ISR is running late.
+ *
+ * Worst-case cycle budget at 16MHz (8 separate slots all due in one interrupt, port outputs), excluding the gate pulse delay:
+ * - entry/exit (vector jump, register save/restore, reti): ~45 cycles
+ * - slot walk (walk_schedule()): ~14 cycles per slot plus ~4 per mask byte, 8 slots = ~210 cycles
+ * - fire: 3 read-modify-write port accesses, ~9 cycles (~20 per register for the shift register chain)
+ * - arm the OCR1B gate release and rearm OCR1A against the edge window: ~30 cycles
+ * - isr_stats: ~35 cycles
+ * Total ~330 cycles = ~21us, against the 64 count (32us) guard between interrupts.  Each extra 8 channels add ~30 cycles of walk.
+ *
+ * The gates are released by ISR(TIMER1_COMPB_vect) gate_pulse_counts later, so this handler never spins with interrupts blocked.  The same
+ * compare also opens and closes the zero-cross edge window; a match for that alone returns before the stats.
+ */
+ISR(TIMER1_COMPA_vect) {
+  uint16_t entry = TCNT1;
+  const schedule_t *schedule = firing_schedule;
+  if(edge_event <= entry) {
+    edge_window_event();
+    if(schedule->times[next_slot] > entry + MIN_INTERRUPT_COUNTS) {
+      arm_compare(schedule->times[next_slot]);
+      return;
+    }
+  }
+  uint16_t lateness = entry - OCR1A;
+  if(isr_stats.fires != 0xffff) {
+    isr_stats.fires++;
+    isr_stats.lateness_sum += lateness;
+  }
+  if(lateness < isr_stats.lateness_min) {
+    isr_stats.lateness_min = lateness;
+  }
+  if(lateness > isr_stats.lateness_max) {
+    isr_stats.lateness_max = lateness;
+  }
+  if(next_slot % 2 == 0) {
+    PORTB |= LED_PORTB_MASK;
+  } else {
+    PORTB &= ~LED_PORTB_MASK;
+  }
+  uint8_t fire[GATE_MASK_BYTES] = {0};
+  next_slot = walk_schedule(schedule, next_slot, entry, fire, isr_stats.late_slots);
+  output_fire(fire);
+  // triac On propogation delay, ended by the OCR1B compare rather than a busy-wait
+  OCR1B = TCNT1 + gate_pulse_counts;
+  TIFR1 = (1 << OCF1B); // discard any stale match
+  TIMSK1 |= (1 << OCIE1B);
+  arm_compare(schedule->times[next_slot]); // set up next interrupt, or park it until the next zero cross
+}
+
+/**
+ * @brief Gate pulse release: one-shot compare armed by ISR(TIMER1_COMPA_vect).
+ *
+ * Gates are only ever held for the pulse width, so every gate pin is simply dropped rather than tracking which ones fired.
+ */
+ISR(TIMER1_COMPB_vect) {
+  output_release();
+  TIMSK1 &= ~(1 << OCIE1B);
+}
+
+/**
+ * @brief Claim the back buffer for writing.
+ *
+ * Withdrawing any unclaimed publication first means zero_cross_int() cannot flip to the buffer while it is being written, and active_schedule
+ * cannot change until publish_schedule() is called.
+ */
+schedule_t *begin_schedule() {
+  schedule_pending = false;
+  return &schedules[active_schedule ^ 1];
+}
+
+/**
+ * @brief Hand the buffer returned by begin_schedule() to the ISRs from the next zero cross.
+ */
+void publish_schedule() {
+  schedule_pending = true;
+}
+
+#endif
+
+// loop()'s working copy of the schedule: always one entry per channel, always sorted
+command_list_t sorted_commands; // all channels off until setup() clears it
+bool schedule_dirty = false; // sorted_commands has changed since the last publish
+
+/**
+ * @brief Move one channel to a new firing time, keeping sorted_commands in order (see insert_command()).
+ */
+void move_channel(uint8_t channel, uint16_t counts) {
+  if(insert_command(&sorted_commands, channel, counts)) {
+    schedule_dirty = true;
+  }
+}
+
+/**
+ * Slew limit and soft start.
+ *
+ * A channel jumping from off to bright in one half-cycle draws a big inrush from driverless LEDs and cold filaments.  Each channel can have a
+ * limit on how much earlier its firing time may move per half-cycle, and slew_step() walks a limited channel to its target at that rate,
+ * from the end of the half-cycle if it was off (see slew_counts()).  Dimming and switching off are immediate.  The limit is per run of
+ * half_cycle_task(), so a half-cycle loop() misses only slows the ramp.
+ *
+ * At power-on setup() also holds every channel off and slew_step() lets them go one at a time, POWER_ON_STAGGER_HALF_CYCLES apart, so the
+ * restored scene comes up as a sequence of small steps rather than one big one.  Burst channels are resistive loads and aren't held.
+ */
+const uint8_t SLEW_UNIT_COUNTS = 16; // slew_limit units: 8us, so 255 is 4080 counts (~20% of a 50Hz half-cycle) per half-cycle
+const uint8_t POWER_ON_STAGGER_HALF_CYCLES = 8;
+
+uint8_t slew_limit[CHANNELS]; // SLEW_UNIT_COUNTS per half-cycle, 0 for none; persisted
+uint16_t target_counts[CHANNELS]; // each channel's firing time once it has finished slewing
+bool slewing = false; // some channel hasn't reached its target yet
+uint8_t channels_powered = CHANNELS; // channels from here up are held off: the power-on sequence
+uint8_t power_on_wait = 0;
+
+/**
+ * @brief Set a channel's firing time, immediately or through the slew limit.
+ *
+ * @param channel channel number
+ * @param counts firing time in TCNT1 counts from the zero cross, or COMMAND_OFF_TIME
+ */
+void set_channel_counts(uint8_t channel, uint16_t counts) {
+  target_counts[channel] = counts;
+  if(channel >= channels_powered) {
+    slewing = true;
+  } else if(slew_limit[channel] == 0 || counts >= command_time(&sorted_commands, channel)) {
+    move_channel(channel, counts);
+  } else {
+    slewing = true;
+  }
+}
+
+/**
+ * @brief Advance the power-on sequence, and move every slewing channel one half-cycle's step towards its target.
+ */
+void slew_step() {
+  if(channels_powered < CHANNELS && ++power_on_wait >= POWER_ON_STAGGER_HALF_CYCLES) {
+    power_on_wait = 0;
+    channels_powered++;
+  }
+  if(!slewing) {
+    return;
+  }
+  slewing = channels_powered < CHANNELS;
+  for(int i = 0; i < channels_powered; i++) {
+    uint16_t current = command_time(&sorted_commands, i);
+    if(current == target_counts[i]) {
+      continue;
+    }
+    uint16_t next = slew_counts(current, target_counts[i], slew_limit[i] * SLEW_UNIT_COUNTS, half_period);
+    move_channel(i, next);
+    slewing |= next != target_counts[i];
+  }
+}
+
+/**
+ * @brief Hold every channel off until slew_step() powers them on in turn.
+ */
+void begin_power_on() {
+  channels_powered = 0;
+  power_on_wait = 0;
+  slewing = true;
+  for(int i = 0; i < CHANNELS; i++) {
+    move_channel(i, COMMAND_OFF_TIME);
+  }
+}
+
+// stagger mode: spread coincident channels a slot apart, with this node's own offset (see stagger_commands())
+bool stagger = false;
+int16_t stagger_offset = 0; // TCNT1 counts, assigned per node by the host
+command_list_t staggered_commands;
+
+/**
+ * @brief Publish sorted_commands to the ISRs, staggered if enabled and merged into slots by build_schedule(), if anything changed since last
+ * time.
+ */
+void update_schedule() {
+  if(!schedule_dirty) {
+    return;
+  }
+  const command_list_t *commands = &sorted_commands;
+  if(stagger) {
+    uint16_t latest = ((uint32_t)FIRING_CUTOFF * half_period) >> 16;
+    stagger_commands(&sorted_commands, &staggered_commands, stagger_offset, latest);
+    commands = &staggered_commands;
+  }
+#ifdef POLLING_FALLBACK
+  for(int i = 0; i < CHANNELS; i++) {
+    uint16_t tick = commands->times[i] / POLL_TICK_COUNTS; // COMMAND_OFF_TIME lands past POLL_OFF_TICK
+    tick = tick ? tick : 1; // the ISR's first tick after an edge is 1
+    lux[commands->channels[i]] = tick < POLL_OFF_TICK ? tick : POLL_OFF_TICK; // single bytes, so no lock against the ISR
+  }
+#else
+  build_schedule(begin_schedule(), commands, channel_masks);
+  publish_schedule();
+#endif
+  schedule_dirty = false;
+}
+
+// mains compensation: ADC channel of the mains sense, A7 by default since it's analog only on the nano and can never be a gate
+#ifndef MAINS_SENSE_CHANNEL
+#define MAINS_SENSE_CHANNEL 7
+#endif
+#if defined(MAINS_COMPENSATION) && !defined(OUTPUT_SHIFT_REGISTER)
+static_assert(MAINS_SENSE_CHANNEL > 5 || (GATE_MASK_PORTC & pin_bit(14 + MAINS_SENSE_CHANNEL)) == 0, "MAINS_SENSE_CHANNEL is a gate pin");
+#endif
+
+/**
+ * Mains voltage compensation (-DMAINS_COMPENSATION).
+ *
+ * A phase-controlled load's power goes with the square of the mains voltage, so a 5% sag dims it by ~10%.  With compensation the ADC
+ * free-runs on a scaled mains sense (AC coupled and biased to VCC/2, within 0-5V) at ~9.6k samples/s, and ISR(ADC_vect) sums the squares of
+ * the 8-bit samples, ~2us of every 104us.  Each half-cycle start latches the sum, giving that half-cycle's mean square, which is the RMS
+ * squared and so needs no square root.  update_mains_gain() smooths it over ~8 half-cycles into mains_gain, nominal over measured: the
+ * factor the load's power has lost.  level_to_counts() looks each firing delay up in power_table, scales the power by the gain and looks the
+ * delay that delivers it back up (compensate_delay()), so brightness holds steady without the host resending levels.  Burst channels
+ * aren't compensated.
+ *
+ * CONFIG_MAINS_NOMINAL sets the reference mean square, or 0 takes the current reading: calibrate once at nominal voltage.  Until then the
+ * gain stays 1.  It is limited to MAINS_GAIN_MIN-MAINS_GAIN_MAX, about +25%/-20% of the voltage, beyond which the sense is more likely to be
+ * broken than the mains.
+ */
+const uint16_t MAINS_GAIN_ONE = 256; // mains_gain is Q8.8
+const uint16_t MAINS_GAIN_MIN = 164;
+const uint16_t MAINS_GAIN_MAX = 400;
+const uint8_t MAINS_GAIN_HYSTERESIS = 2; // rescale every channel only when the gain moves by more than this
+
+uint16_t mains_nominal = 0; // reference mean square in ADC counts squared, persisted; 0 until calibrated
+uint16_t mains_gain = MAINS_GAIN_ONE;
+bool mains_calibrate = false; // take the next reading as mains_nominal
+
+#ifdef MAINS_COMPENSATION
+uint32_t mains_square_sum = 0; // ISR only
+uint16_t mains_samples = 0;
+volatile uint32_t mains_half_sum; // the last complete half-cycle, latched by latch_mains_sample()
+volatile uint16_t mains_half_samples;
+volatile bool mains_half_ready = false;
+uint32_t mains_filtered_q3 = 0; // smoothed mean square, times 8
+
+void initialize_adc() {
+  ADMUX = (1 << REFS0) | (1 << ADLAR) | MAINS_SENSE_CHANNEL; // AVcc reference, 8-bit result in ADCH
+  ADCSRB = 0; // free running
+  ADCSRA = (1 << ADEN) | (1 << ADSC) | (1 << ADATE) | (1 << ADIE) | (1 << ADPS2) | (1 << ADPS1) | (1 << ADPS0); // /128: 125kHz, 13 clocks
+}
+
+ISR(ADC_vect) {
+  int8_t sample = ADCH - 128;
+  mains_square_sum += sample * sample;
+  mains_samples++;
+}
+#endif
+
+/**
+ * @brief Hand the half-cycle's mains samples to update_mains_gain().  Called by the ISR that starts each half-cycle.
+ */
+inline void latch_mains_sample() {
+#ifdef MAINS_COMPENSATION
+  mains_half_sum = mains_square_sum;
+  mains_half_samples = mains_samples;
+  mains_half_ready = true;
+  mains_square_sum = 0;
+  mains_samples = 0;
+#endif
+}
+
+void config_changed();
+
+/**
+ * @brief Fold the last half-cycle's mean square into the smoothed reading and work out the gain from it.
+ *
+ * @return true if mains_gain changed and firing counts should be recomputed
+ */
+bool update_mains_gain() {
+#ifdef MAINS_COMPENSATION
+  noInterrupts();
+  bool ready = mains_half_ready;
+  uint32_t sum = mains_half_sum;
+  uint16_t samples = mains_half_samples;
+  mains_half_ready = false;
+  interrupts();
+  if(!ready || samples == 0) {
+    return false;
+  }
+  uint16_t mean_square = sum / samples;
+  if(mains_filtered_q3 == 0) {
+    mains_filtered_q3 = (uint32_t)mean_square << 3;
+  }
+  mains_filtered_q3 += mean_square - (int32_t)(mains_filtered_q3 >> 3);
+  uint16_t measured = mains_filtered_q3 >> 3;
+  if(mains_calibrate) {
+    mains_calibrate = false;
+    mains_nominal = measured;
+    config_changed();
+  }
+  if(mains_nominal == 0 || measured == 0) {
+    return false;
+  }
+  uint32_t gain = ((uint32_t)mains_nominal << 8) / measured;
+  if(gain < MAINS_GAIN_MIN) {
+    gain = MAINS_GAIN_MIN;
+  }
+  if(gain > MAINS_GAIN_MAX) {
+    gain = MAINS_GAIN_MAX;
+  }
+  if(abs((int16_t)gain - (int16_t)mains_gain) <= MAINS_GAIN_HYSTERESIS) {
+    return false;
+  }
+  mains_gain = gain;
+  return true;
+#else
+  return false;
+#endif
+}
+
+/**
+ * @brief Power delivered when firing at a delay (both Q0.16), interpolated from power_table.
+ */
+uint16_t delay_power(uint16_t delay) {
+  uint8_t i = delay >> 10; // POWER_TABLE_STEPS = 64
+  uint16_t frac = delay & 0x3ff;
+  uint16_t earlier = pgm_read_word(&power_table[i]);
+  uint16_t later = pgm_read_word(&power_table[i+1]);
+  return earlier - (((uint32_t)(earlier - later) * frac) >> 10);
+}
+
+/**
+ * @brief The delay that delivers a power, the inverse of delay_power(): a binary search of power_table, which falls monotonically.
+ */
+uint16_t power_delay(uint16_t power) {
+  uint8_t earlier = 0;
+  uint8_t later = POWER_TABLE_STEPS;
+  while(later - earlier > 1) {
+    uint8_t mid = (earlier + later) / 2;
+    if(pgm_read_word(&power_table[mid]) > power) {
+      earlier = mid;
+    } else {
+      later = mid;
+    }
+  }
+  uint16_t high = pgm_read_word(&power_table[earlier]);
+  uint16_t low = pgm_read_word(&power_table[later]);
+  if(power >= high) {
+    return (uint16_t)earlier << 10;
+  }
+  return ((uint16_t)earlier << 10) + (((uint32_t)(high - power) << 10) / (high - low));
+}
+
+/**
+ * @brief Move a firing delay to deliver mains_gain times its power, see the mains compensation comment.
+ */
+uint16_t compensate_delay(uint16_t delay) {
+  if(mains_gain == MAINS_GAIN_ONE) {
+    return delay;
+  }
+  uint32_t power = ((uint32_t)delay_power(delay) * mains_gain) >> 8;
+  return power_delay(power < 0xffff ? power : 0xffff);
+}
+
+/**
+ * Firing window calibration.
+ *
+ * The level tables spread their steps over the window they were generated for, LEVEL_TABLE_EARLIEST to LEVEL_TABLE_LATEST.  A board whose
+ * loads want another window (a driver that won't strike late in the half-cycle, say) sets CONFIG_FIRING_EARLIEST and CONFIG_FIRING_LATEST
+ * instead of regenerating the table: window_delay() maps each table delay linearly onto the calibrated window, with a Q2.14 scale worked
+ * out once per change so there is no division per level.  Both are Q0.16 fractions of the half-cycle, like the table entries.
+ */
+const uint16_t FIRING_EARLIEST_MIN = 0x0ccd; // 5%, clear of the burst pulse and the edge window after the zero cross
+uint16_t firing_earliest = LEVEL_TABLE_EARLIEST; // persisted
+uint16_t firing_latest = LEVEL_TABLE_LATEST; // persisted
+uint16_t firing_scale_q14 = 1 << 14;
+
+/**
+ * @brief Move the firing window, rescaling every channel.
+ *
+ * @return false, and nothing changed, unless FIRING_EARLIEST_MIN <= earliest < latest <= FIRING_CUTOFF
+ */
+bool set_firing_window(uint16_t earliest, uint16_t latest) {
+  if(earliest < FIRING_EARLIEST_MIN || latest > FIRING_CUTOFF || earliest >= latest) {
+    return false;
+  }
+  firing_earliest = earliest;
+  firing_latest = latest;
+  firing_scale_q14 = ((uint32_t)(latest - earliest) << 14) / (LEVEL_TABLE_LATEST - LEVEL_TABLE_EARLIEST);
+  return true;
+}
+
+/**
+ * @brief Map a delay from LEVEL_TABLE onto the calibrated firing window.
+ */
+uint16_t window_delay(uint16_t delay) {
+  if(firing_earliest == LEVEL_TABLE_EARLIEST && firing_latest == LEVEL_TABLE_LATEST) {
+    return delay;
+  }
+  uint16_t offset = delay > LEVEL_TABLE_EARLIEST ? delay - LEVEL_TABLE_EARLIEST : 0;
+  return firing_earliest + (((uint32_t)offset * firing_scale_q14) >> 14);
+}
+
+/**
+ * @brief Convert a brightness level to a firing time for the current half_period.
+ *
+ * The high byte indexes LEVEL_TABLE and the low byte interpolates to the next entry, then a 16x16 multiply scales to counts; no float.  The
+ * table spreads its entries over the firing window it was generated for (see tools/gen_level_table.py), stretched onto the calibrated one
+ * by window_delay(), and every non-zero level below 0x0100 gets the table's lowest step.
+ *
+ * @param level 0 (off) to 0xffff (full)
+ * @return firing time in TCNT1 counts, or COMMAND_OFF_TIME
+ */
+uint16_t level_to_counts(uint16_t level) {
+  if(level == 0) {
+    return COMMAND_OFF_TIME;
+  }
+  uint8_t i = level >> 8;
+  uint8_t frac = level & 0xff;
+  if(i == 0) {
+    i = 1;
+    frac = 0;
+  }
+  uint16_t delay = pgm_read_word(&LEVEL_TABLE[i]);
+  if(frac && i < 255) {
+    uint16_t brighter = pgm_read_word(&LEVEL_TABLE[i+1]);
+    delay -= ((uint32_t)(delay - brighter) * frac) >> 8;
+  }
+  delay = window_delay(delay);
+#ifdef MAINS_COMPENSATION
+  delay = compensate_delay(delay);
+#endif
+  return ((uint32_t)delay * half_period) >> 16;
+}
+
+uint16_t channel_level[CHANNELS]; // last level set on each channel, kept so firing counts can be rescaled
+
+/**
+ * Burst fire.
+ *
+ * Channels in burst mode aren't phase controlled at all: they conduct for whole mains cycles, and their level is the share of cycles they
+ * conduct for, spread as evenly as possible by a Bresenham accumulator.  That suits heaters and other resistive loads, switches only at the
+ * zero cross (far less EMI), and costs one decision per cycle in start_half_cycle() instead of a compare slot.  Decisions are made on even
+ * half-cycles and held for the odd one, so a burst load never sees a DC component.  The gate is held for BURST_PULSE_COUNTS from the
+ * predicted zero, twice the PLL's capture range, so the triac latches as the voltage rises even when the true crossing lands late.
+ */
+const uint16_t BURST_PULSE_COUNTS = 800; // 400us
+uint8_t burst_channels[CHANNEL_MASK_BYTES]; // channels in burst mode
+volatile uint16_t burst_level[CHANNELS]; // share of cycles to conduct, 0xffff for all; only set for burst channels
+uint16_t burst_accumulator[CHANNELS]; // ISR only
+uint8_t burst_fire[GATE_MASK_BYTES]; // this cycle's decision, ISR only
+bool burst_firing = false;
+
+inline bool is_burst_channel(uint8_t channel) {
+  return burst_channels[channel / 8] & (1 << (channel % 8));
+}
+
+/**
+ * @brief Set a channel's brightness.
+ *
+ * @param channel channel number
+ * @param level 0 (off) to 0xffff (full)
+ */
+void set_channel_level(uint8_t channel, uint16_t level) {
+  channel_level[channel] = level;
+  if(is_burst_channel(channel)) {
+    noInterrupts();
+    burst_level[channel] = level;
+    interrupts();
+    set_channel_counts(channel, COMMAND_OFF_TIME); // out of the phase schedule
+  } else {
+    set_channel_counts(channel, level_to_counts(level));
+  }
+}
+
+/**
+ * @brief Switch a channel between phase control and burst fire, keeping its level.
+ */
+void set_channel_burst(uint8_t channel, bool burst) {
+  if(burst) {
+    burst_channels[channel / 8] |= 1 << (channel % 8);
+  } else {
+    burst_channels[channel / 8] &= ~(1 << (channel % 8));
+    noInterrupts();
+    burst_level[channel] = 0;
+    interrupts();
+  }
+  set_channel_level(channel, channel_level[channel]);
+}
+
+/**
+ * @brief Recompute every channel's firing count, after half_period has changed.
+ */
+void rescale_channels() {
+  for(int i = 0; i < CHANNELS; i++) {
+    set_channel_level(i, channel_level[i]);
+  }
+}
+
+#ifndef POLLING_FALLBACK
+void initialize_timer1() {
+  cli(); // stop interrupts
+  TCCR1A = 0; // set entire TCCR1A register to 0
+  TCCR1B = 0; // same for TCCR1B
+  TCNT1  = 0; // initialize counter value to 0
+  // nothing to fire until the first half-cycle starts
+  OCR1A = 0xffff;
+  // free-run until the PLL has a period to count to
+  ICR1 = 0xffff;
+
+  // turn on CTC mode with ICR1 as TOP, so the counter wraps at the PLL's predicted zero cross
+  TCCR1B |= (1 << WGM13) | (1 << WGM12);
+  // Set CS11 bit for 8 prescaler
+  TCCR1B |= (1 << CS11);
+  // enable timer compare interrupt, and the capture interrupt which fires at TOP in this mode
+  TIMSK1 |= (1 << OCIE1A) | (1 << ICIE1);
+  sei(); // allow interrupts
+}
+#endif
+
+/**
+ * @brief Power down every peripheral the firmware doesn't use: the ADC (unless -DMAINS_COMPENSATION), analog comparator, TWI, Timer2
+ * (Timer1 instead with -DPOLLING_FALLBACK) and (without the shift register outputs) SPI.  Timer0 (millis()), INT0 and USART0 stay on.
+ */
+void initialize_power_reduction() {
+  ACSR |= (1 << ACD);
+#ifdef POLLING_FALLBACK
+  uint8_t prr = (1 << PRTWI) | (1 << PRTIM1);
+#else
+  uint8_t prr = (1 << PRTWI) | (1 << PRTIM2);
+#endif
+#ifndef MAINS_COMPENSATION
+  ADCSRA &= ~(1 << ADEN); // the ADC must be off before its clock is stopped
+  prr |= (1 << PRADC);
+#endif
+#ifndef OUTPUT_SHIFT_REGISTER
+  prr |= (1 << PRSPI);
+#endif
+  PRR = prr;
+}
+
+
+/**
+ * Zero-cross phase-locked loop.
+ *
+ * Timer1 counts the half-cycle itself, wrapping at ICR1 to the PLL's estimate of the mains half period, and ISR(TIMER1_CAPT_vect) starts each
+ * half-cycle at that wrap.  The zero-cross edge is only a correction input: its offset from the predicted wrap nudges the period (integral term)
+ * and stretches or shrinks the current half-cycle (proportional term).  Edges too far from the prediction are ignored, so a noise spike can no
+ * longer truncate a half-cycle.  Until the period has been measured over PLL_LOCK_EDGES consistent edges the loop runs open, resyncing on
+ * every edge like the old detector.  The arithmetic and tuning constants live in dimmer_core.h.
+ */
+volatile uint16_t previous_zero_cross = 0;
+volatile bool pll_locked = false; // with -DPOLLING_FALLBACK, the last edge was a plausible half period after the one before
+volatile uint8_t half_cycle_count = 0; // free-running, one per half-cycle started
+
+/**
+ * @brief Burst fire decision and gate pulse at the start of a half-cycle, see the burst fire comment.
+ *
+ * ~15 cycles per channel on even half-cycles, just the pulse on odd ones.
+ */
+void fire_bursts() {
+  if(half_cycle_count % 2 == 0) {
+    for(int b = 0; b < GATE_MASK_BYTES; b++) {
+      burst_fire[b] = 0;
+    }
+    burst_firing = false;
+    for(int i = 0; i < CHANNELS; i++) {
+      uint16_t level = burst_level[i];
+      if(level == 0) {
+        continue;
+      }
+      uint16_t accumulator = burst_accumulator[i] + level;
+      if(accumulator < burst_accumulator[i] || level == 0xffff) {
+        for(int b = 0; b < GATE_MASK_BYTES; b++) {
+          burst_fire[b] |= channel_masks[i][b];
+        }
+        burst_firing = true;
+      }
+      burst_accumulator[i] = accumulator;
+    }
+  }
+  if(!burst_firing) {
+    return;
+  }
+  output_fire(burst_fire);
+#ifndef POLLING_FALLBACK
+  OCR1B = TCNT1 + BURST_PULSE_COUNTS;
+  TIFR1 = (1 << OCF1B);
+  TIMSK1 |= (1 << OCIE1B);
+#endif
+}
+
+#ifdef POLLING_FALLBACK
+
+void initialize_timer2() {
+  cli();
+  TCCR2A = (1 << WGM21); // CTC, TOP = OCR2A
+  TCCR2B = (1 << CS21); // /8 prescaler
+  TCNT2 = 0;
+  OCR2A = POLL_TICK_COUNTS - 1;
+  TIMSK2 = (1 << OCIE2A);
+  sei();
+}
+
+/**
+ * @brief Polling tick: fire every channel that fell due this tick, see the polling fallback comment.
+ *
+ * ~10 cycles per channel, every 100us.
+ */
+ISR(TIMER2_COMPA_vect) {
+  isr_heartbeat = true;
+  // the gate pulse is one tick wide: release whatever fired last tick before deciding what fires now
+  output_release();
+  if(clock_tick >= POLL_MAX_TICKS) {
+    return;
+  }
+  clock_tick++;
+  if(clock_tick > poll_sync_ticks) {
+    return; // the crossing is overdue: loss of sync
+  }
+  uint8_t fire[GATE_MASK_BYTES] = {0};
+  if(burst_firing && clock_tick <= BURST_PULSE_TICKS) {
+    for(int b = 0; b < GATE_MASK_BYTES; b++) {
+      fire[b] = burst_fire[b];
+    }
+  }
+  for(int i = 0; i < CHANNELS && clock_tick <= poll_cutoff_ticks; i++) {
+    if(lux[i] == clock_tick) {
+      for(int b = 0; b < GATE_MASK_BYTES; b++) {
+        fire[b] |= channel_masks[i][b];
+      }
+    }
+  }
+  output_fire(fire);
+}
+
+/**
+ * @brief Zero-cross edge: restart the tick count, and measure the half period it just ended.
+ */
+void zero_cross_int() {
+  uint16_t measured = clock_tick * POLL_TICK_COUNTS + TCNT2;
+  if(measured < PLL_MIN_PERIOD && clock_tick < POLL_MAX_TICKS) {
+    isr_stats.rejected_edges++;
+    return; // too soon after the last edge: noise
+  }
+  previous_zero_cross = measured;
+  pll_locked = measured <= PLL_MAX_PERIOD;
+  if(pll_locked) {
+    measured_half_period = measured;
+    uint8_t half_ticks = measured / POLL_TICK_COUNTS;
+    poll_sync_ticks = half_ticks + 2;
+    poll_cutoff_ticks = half_ticks - half_ticks / POLL_CUTOFF_DIVISOR;
+  }
+  TCNT2 = 0;
+  clock_tick = 0;
+  output_release();
+  latch_mains_sample();
+  half_cycle_count++;
+  isr_stats.half_cycles++;
+  fire_bursts();
+}
+
+#else
+
+int32_t pll_period_q8 = (int32_t)HALF_PERIOD_50HZ << 8; // half period, 24.8 fixed point
+uint8_t pll_lock_count = 0;
+uint8_t pll_missed_edges = 0;
+
+/**
+ * @brief Begin a half-cycle: latch the schedule, fire the burst channels and arm the first slot.
+ */
+void start_half_cycle() {
+  latch_mains_sample();
+  half_cycle_count++;
+  isr_stats.half_cycles++;
+  isr_stats.missed_slots += firing_schedule->slots - next_slot;
+  next_slot = 0;
+  release_gates();
+  PORTB &= ~LED_PORTB_MASK;
+  // pick up a newly published schedule only here, so a half-cycle never mixes two tables
+  if(schedule_pending) {
+    active_schedule ^= 1;
+    schedule_pending = false;
+  }
+  firing_schedule = &schedules[active_schedule];
+  isr_heartbeat = true;
+  fire_bursts();
+  if(pll_locked) {
+    if(edge_window_open) {
+      edge_event = PLL_CAPTURE_COUNTS; // the crossing may still come just after the wrap
+    } else {
+      schedule_edge_window();
+    }
+  }
+  arm_compare(firing_schedule->times[0]); // set up next interrupt
+}
+
+/**
+ * @brief Drop back to open-loop acquisition, firing nothing until the next edge.
+ */
+void pll_unlock() {
+  if(!sync_lost) {
+    isr_stats.sync_losses++;
+    sync_lost = true;
+  }
+  pll_locked = false;
+  pll_lock_count = 0;
+  ICR1 = 0xffff;
+  release_gates();
+  next_slot = firing_schedule->slots;
+  open_edge_window();
+  OCR1A = 0xffff;
+}
+
+/**
+ * @brief Timer1 reached TOP: the PLL's predicted zero cross.
+ */
+ISR(TIMER1_CAPT_vect) {
+  isr_heartbeat = true; // wraps every ~33ms even with no mains
+  if(!pll_locked || ++pll_missed_edges > PLL_COAST_CYCLES) {
+    pll_unlock();
+    return;
+  }
+  measured_half_period = pll_period_q8 >> 8;
+  ICR1 = measured_half_period - 1;
+  start_half_cycle();
+}
+
+void zero_cross_int() // function to be fired at the zero crossing to dim the light
+{
+  // Every zerocrossing interrupt: For 50Hz (1/2 Cycle) => 10ms ; For 60Hz (1/2 Cycle) => 8.33ms
+  // 10ms=10000us , 8.33ms=8330us
+  uint16_t now = TCNT1;
+  previous_zero_cross = now;
+
+  if(!pll_locked) {
+    if(now < 1000) {
+      isr_stats.rejected_edges++;
+      return;
+    }
+    TCNT1 = 0;
+    sync_lost = false;
+    start_half_cycle();
+    // a fresh count from the last resync is a direct measurement of the period
+    if(pll_acquire_edge(now, pll_period_q8, pll_lock_count)) {
+      pll_lock_count++;
+    } else {
+      pll_lock_count = 0;
+    }
+    if(pll_lock_count > 0) {
+      pll_period_q8 = (int32_t)now << 8;
+    }
+    if(pll_lock_count >= PLL_LOCK_EDGES) {
+      pll_locked = true;
+      pll_missed_edges = 0;
+      ICR1 = now - 1;
+      close_edge_window(); // this edge is the crossing
+      schedule_edge_window();
+      arm_compare(firing_schedule->times[next_slot]);
+    }
+    return;
+  }
+
+  int16_t error = pll_phase_error(now, ICR1);
+  if(!pll_in_capture(error)) {
+    isr_stats.rejected_edges++;
+    return; // noise, or a crossing we will coast through
+  }
+  pll_missed_edges = 0;
+
+  pll_period_q8 = pll_integrate(pll_period_q8, error);
+
+  // stretch or shrink the half-cycle in progress to pull the phase in, never setting TOP behind the counter
+  uint16_t new_top = pll_top(pll_period_q8, error);
+  uint16_t earliest = TCNT1 + 16; // TOP written behind the counter would run it out to 0xffff
+  if(new_top < earliest) {
+    new_top = earliest;
+  }
+  ICR1 = new_top;
+
+  // one crossing per window: anything else until the next one is noise
+  close_edge_window();
+  if(error >= 0) {
+    schedule_edge_window(); // taken at or just after the wrap, so the next crossing is at the new TOP
+  } else {
+    edge_event = 0xffff; // taken before the wrap; start_half_cycle() schedules the next window
+  }
+  arm_compare(firing_schedule->times[next_slot]);
+}
+
+#endif
+
+/**
+ * @brief Pick up the PLL's latest half period and classify the mains frequency from it.
+ *
+ * Small movements are ignored so levels are not rescaled on every half-cycle of PLL jitter.
+ *
+ * @return true if half_period changed and firing counts should be recomputed
+ */
+bool update_half_period() {
+  noInterrupts();
+  uint16_t measured = measured_half_period;
+  interrupts();
+  if(measured == 0 || abs((int16_t)(measured - half_period)) < (int16_t)(half_period / 256)) {
+    return false;
+  }
+  half_period = measured;
+  mains_hz = measured < (HALF_PERIOD_50HZ + HALF_PERIOD_60HZ) / 2 ? 60 : 50;
+  gate_pulse_counts = mains_hz == 60 ? GATE_PULSE_COUNTS_60HZ : GATE_PULSE_COUNTS_50HZ;
+  return true;
+}
+
+void load_config();
+void begin_supervisor();
+void host_heartbeat();
+
+#ifdef ISR_CYCLES
+// built into bench/isr_cycles.cpp, which brings its own setup() and loop() and calls these itself to time the real ISRs
+#define setup firmware_setup
+#define loop firmware_loop
+#endif
+
+void setup() {
+  clear_commands(&sorted_commands);
+  pinMode(SYNC_PIN, INPUT_PULLUP); // for firing angle control
+  initialize_power_reduction();
+  initialize_outputs();
+#ifdef POLLING_FALLBACK
+  for(int i = 0; i < CHANNELS; i++) {
+    lux[i] = POLL_OFF_TICK;
+  }
+  attachInterrupt(digitalPinToInterrupt(SYNC_PIN), zero_cross_int, RISING);
+  initialize_timer2();
+#else
+  clear_schedule(&schedules[0]);
+  clear_schedule(&schedules[1]);
+  attachInterrupt(digitalPinToInterrupt(SYNC_PIN), zero_cross_int, RISING);
+  initialize_timer1();
+#endif
+#ifdef MAINS_COMPENSATION
+  initialize_adc();
+#endif
+  // restore the last scene before the first zero cross, so the lights come back as soon as the PLL starts the half-cycles
+  load_config();
+  begin_power_on();
+  update_schedule();
+#ifdef DMX_MODE
+  dmx_begin(dmx_start_address, CHANNELS);
+#else
+  uart_begin(115200);
+#endif
+#ifdef BUS_MODE
+  uart_rs485(BUS_DE_PIN);
+#endif
+  begin_supervisor();
+}
+
+/**
+ * Effect engine.
+ *
+ * Effects are functions of a 16-bit phase (65536 = one full cycle of the effect) advanced by effect_rate every half-cycle, so the animation
+ * speed is tied to the mains clock rather than to how long loop() takes.  Everything is integer: sines come from a quarter-wave table with
+ * linear interpolation, and levels are computed in Q0.16, the same scale set_channel_level() takes.
+ */
+enum effect_t {
+  EFFECT_NONE, // levels are left to the host
+  EFFECT_FADE, // all channels fade linearly up and down together
+  EFFECT_BREATHE, // all channels follow a squared sine, slow at the bottom
+  EFFECT_CHASE, // a bright spot with a short tail runs across the channels
+  EFFECT_DUAL_SINE // two sines per channel multiplied together, which makes it more 0 than 1
+};
+
+uint8_t effect = EFFECT_DUAL_SINE;
+uint16_t effect_phase = 0;
+uint16_t effect_rate = 6; // phase per half-cycle: ~110s per cycle at 50Hz, around the old 1024 steps of delay_time
+uint8_t effect_last_half_cycle = 0;
+
+// sin(i * pi/128) * 32767, one quarter wave plus the end point
+const int16_t quarter_sine[65] PROGMEM = {
+      0,   804,  1608,  2410,  3212,  4011,  4808,  5602,
+   6393,  7179,  7962,  8739,  9512, 10278, 11039, 11793,
+  12539, 13279, 14010, 14732, 15446, 16151, 16846, 17530,
+  18204, 18868, 19519, 20159, 20787, 21403, 22005, 22594,
+  23170, 23731, 24279, 24811, 25329, 25832, 26319, 26790,
+  27245, 27683, 28105, 28510, 28898, 29268, 29621, 29956,
+  30273, 30571, 30852, 31113, 31356, 31580, 31785, 31971,
+  32137, 32285, 32412, 32521, 32609, 32678, 32728, 32757,
+  32767,
+};
+
+/**
+ * @brief Fixed point sine.
+ *
+ * @param phase 0-65535 for one full turn
+ * @return sin(phase) in Q1.15
+ */
+int16_t sine_q15(uint16_t phase) {
+  uint8_t quadrant = phase >> 14;
+  uint16_t index = phase & 0x3fff;
+  if(quadrant & 1) {
+    index = 0x4000 - index; // mirror the second and fourth quadrants
+  }
+  uint8_t i = index >> 8;
+  uint8_t frac = index & 0xff;
+  int16_t a = pgm_read_word(&quarter_sine[i]);
+  int16_t value = a;
+  if(frac) {
+    int16_t b = pgm_read_word(&quarter_sine[i+1]);
+    value += ((int32_t)(b - a) * frac) >> 8;
+  }
+  return quadrant & 2 ? -value : value;
+}
+
+/**
+ * @brief (1 + sin(phase)) / 2 in Q0.16.
+ */
+uint16_t wave_q16(uint16_t phase) {
+  return sine_q15(phase) + 32768;
+}
+
+/**
+ * @brief Level of one channel for the current effect, in Q0.16.
+ */
+uint16_t effect_level_q16(uint8_t channel) {
+  uint16_t p = effect_phase;
+  switch(effect) {
+    case EFFECT_FADE:
+      return p < 0x8000 ? p << 1 : (0xffff - p) << 1;
+    case EFFECT_BREATHE: {
+      uint16_t w = wave_q16(p);
+      return ((uint32_t)w * w) >> 16;
+    }
+    case EFFECT_CHASE: {
+      uint16_t spacing = 0x10000 / CHANNELS;
+      uint16_t pos = p - channel * spacing; // channels evenly spaced around the cycle
+      return pos < 2 * (uint32_t)spacing ? 0xffff - (((uint32_t)pos * CHANNELS) >> 1) : 0; // head at pos 0, tail two channels long
+    }
+    case EFFECT_DUAL_SINE:
+    default:
+      // x = (1+sin(p+i))/2 * (1+sin(p+i*1.61))/2, with 1 radian = 10430 phase units
+      return ((uint32_t)wave_q16(p + channel * 10430u) * wave_q16(p + channel * 16793u)) >> 16;
+  }
+}
+
+/**
+ * @brief Advance the effect by however many half-cycles have started since the last call, and set every channel from it.
+ */
+void effect_step() {
+  uint8_t now = half_cycle_count;
+  uint8_t elapsed = now - effect_last_half_cycle;
+  effect_last_half_cycle = now;
+  if(effect == EFFECT_NONE || elapsed == 0) {
+    return;
+  }
+  effect_phase += effect_rate * elapsed;
+  for(int i = 0; i < CHANNELS; i++) {
+    set_channel_level(i, effect_level_q16(i));
+  }
+}
+
+/**
+ * Fade engine.
+ *
+ * Each channel can glide to a target level over a number of half-cycles, so the host sends one OP_FADE instead of streaming intermediate
+ * levels.  Every half-cycle a fading channel moves by its remaining distance divided by its remaining half-cycles, which is a straight line
+ * that lands exactly on the target however the division rounds along the way.  Channels that don't move don't touch the schedule.
+ */
+uint16_t fade_target[CHANNELS];
+uint16_t fade_remaining[CHANNELS]; // half-cycles left, 0 when not fading
+uint8_t fade_last_half_cycle = 0;
+
+/**
+ * @brief Start a fade from a channel's current level.
+ *
+ * @param half_cycles duration; 0 jumps straight to the target
+ */
+void fade_channel(uint8_t channel, uint16_t target, uint16_t half_cycles) {
+  fade_target[channel] = target;
+  fade_remaining[channel] = half_cycles;
+  if(half_cycles == 0) {
+    set_channel_level(channel, target);
+  }
+}
+
+void fade_cancel(uint8_t channel) {
+  fade_remaining[channel] = 0;
+}
+
+/**
+ * @brief Advance every fading channel by however many half-cycles have started since the last call.
+ */
+void fade_step() {
+  uint8_t now = half_cycle_count;
+  uint8_t elapsed = now - fade_last_half_cycle;
+  fade_last_half_cycle = now;
+  if(elapsed == 0) {
+    return;
+  }
+  for(int i = 0; i < CHANNELS; i++) {
+    uint16_t remaining = fade_remaining[i];
+    if(remaining == 0) {
+      continue;
+    }
+    if(remaining <= elapsed) {
+      fade_remaining[i] = 0;
+      set_channel_level(i, fade_target[i]);
+      continue;
+    }
+    int32_t distance = (int32_t)fade_target[i] - channel_level[i];
+    fade_remaining[i] = remaining - elapsed;
+    set_channel_level(i, channel_level[i] + distance * elapsed / remaining);
+  }
+}
 
 /**
- * Different strategy: store the lux and pin values in increasing order and then just iterate through them in the timerIsr function
-*/
+ * @brief In DMX mode, take over every channel from the latest complete DMX packet, stopping any effect.
+ *
+ * Called once per half-cycle, which is faster than DMX's 44Hz maximum refresh, so no packet is skipped.
+ */
+void dmx_step() {
+#ifdef DMX_MODE
+  uint8_t levels[CHANNELS];
+  if(!dmx_read(levels)) {
+    return;
+  }
+  host_heartbeat();
+  effect = EFFECT_NONE;
+  for(int i = 0; i < CHANNELS; i++) {
+    set_channel_level(i, levels[i] * 257); // 0-255 to 0-0xffff
+  }
+#endif
+}
 
 /**
- * @brief Interrupt service routine for Timer1 interrupt
- * 
- * This function is called every time the Timer1 interrupt is fired.
- * It iterates through the lux array and turns on the triac for the corresponding channel if the clock_tick is less than equal to the lux value.
- * 
- * @return void
- * 
- * @note This function is called every 100 microseconds for 50Hz and 83.33 microseconds for 60Hz.
+ * Cooperative tick scheduler.
+ *
+ * loop() never blocks: each pass runs every task whose interval has elapsed on millis(), and tasks with interval 0 run every pass.  Tasks must
+ * return quickly; anything paced by the mains (effects, schedule updates) checks half_cycle_count itself.
  */
+struct task_t {
+  void (*run)();
+  uint16_t interval_ms;
+  uint16_t last_run_ms;
+};
 
-void timerIsr()
-{
-  clock_tick++;
-  // turn off if loss of sync
-  if(clock_tick > off) {
-    for(int i = 0; i < 8; i++) {
-      digitalWrite(pin_assignments[i], LOW); // triac Off
+const uint16_t TASK_DISABLED = 0xffff; // interval for a task that never runs
+
+void process_serial();
+void half_cycle_task();
+void send_telemetry();
+void config_task();
+void idle_meter_task();
+void supervisor_task();
+
+enum task_id_t {
+  TASK_SERIAL,
+  TASK_HALF_CYCLE,
+  TASK_TELEMETRY,
+  TASK_CONFIG,
+  TASK_IDLE_METER,
+  TASK_SUPERVISOR,
+  TASK_COUNT
+};
+
+task_t tasks[TASK_COUNT] = {
+  {process_serial, 0, 0},
+  {half_cycle_task, 0, 0},
+  {send_telemetry, TASK_DISABLED, 0}, // interval tracks delay_time
+  {config_task, 0, 0},
+  {idle_meter_task, 1000, 0},
+  {supervisor_task, 0, 0},
+};
+
+void run_tasks() {
+  uint16_t now = millis();
+  for(int i = 0; i < TASK_COUNT; i++) {
+    task_t &task = tasks[i];
+    if(task.interval_ms == TASK_DISABLED) {
+      continue;
     }
-    clock_tick = off;
+    if(task.interval_ms == 0 || (uint16_t)(now - task.last_run_ms) >= task.interval_ms) {
+      task.last_run_ms = now;
+      task.run();
+    }
+  }
+}
+
+/**
+ * Supervisor.
+ *
+ * The AVR watchdog resets the board WATCHDOG_TIMEOUT after it was last fed, and supervisor_task() only feeds it when a timer ISR has set
+ * isr_heartbeat since its last pass, so a wedged loop() and stalled firing interrupts both end in a reset; setup() restores the saved scene
+ * within milliseconds of one.  Timer1 wraps at least every ~33ms even with no mains, well inside the timeout.  The cause of every reset
+ * is kept in reset_flags for OP_GET_STATS, and watchdog and brown-out resets are counted in config_t.
+ *
+ * The watchdog needs optiboot (the nanoatmega328new board), see save_reset_flags().  Nanos still on the old bootloader are built with
+ * -DNO_WATCHDOG (the nano_oldboot env), which leaves the watchdog off; everything else here still runs.
+ *
+ * Loss of sync is handled in the ISRs without waiting for the watchdog.  A single missed crossing is coasted through on the PLL's period
+ * estimate, but after PLL_COAST_CYCLES in a row pll_unlock() drops every gate, and nothing fires until a crossing is taken again
+ * (sync_lost).  The polling fallback stops firing altogether a half period and 200us after its last edge.
+ *
+ * With CONFIG_HOST_TIMEOUT set, a host that sends nothing to this node (broadcasts included; in DMX mode, no packets) for that many seconds
+ * is presumed dead, and every channel fades over HOST_TIMEOUT_FADE_MS to the safe scene, CONFIG_SAFE_SCENE from the scene table, or off when
+ * that is SAFE_SCENE_OFF or was never stored.  The next frame from the host ends the timeout; the levels stay until it sets new ones.
+ */
+const uint8_t WATCHDOG_TIMEOUT = WDTO_120MS;
+const uint16_t HOST_TIMEOUT_FADE_MS = 2000;
+const uint8_t SAFE_SCENE_OFF = 0xff;
+
+uint8_t reset_flags __attribute__((section(".noinit"))); // MCUSR at the last reset, saved by save_reset_flags()
+uint8_t watchdog_resets = 0; // persisted, saturating
+uint8_t brownout_resets = 0; // persisted, saturating
+uint8_t host_timeout_s = 0; // persisted, 0 for never
+uint8_t safe_scene = SAFE_SCENE_OFF; // persisted
+uint32_t host_last_ms = 0;
+bool host_lost = false;
+
+/**
+ * @brief Catch the reset cause before anything else runs, and stop a watchdog left running by the reset from firing again during startup.
+ *
+ * Runs from .init3, before the C runtime.  Optiboot clears MCUSR itself and passes the reset flags in r2 instead.  This needs optiboot
+ * (the nanoatmega328new board): the old nano bootloader leaves MCUSR and the watchdog alone after a watchdog reset, and with WDRF set the
+ * watchdog runs at its 15ms minimum, so the board resets again inside the bootloader's wait and never gets here.
+ */
+void save_reset_flags() __attribute__((naked, used, section(".init3")));
+void save_reset_flags() {
+  uint8_t bootloader_flags;
+  __asm__ __volatile__("mov %0, r2" : "=r"(bootloader_flags));
+  reset_flags = MCUSR ? MCUSR : bootloader_flags;
+  MCUSR = 0;
+  wdt_disable();
+}
+
+/**
+ * Persisted configuration: calibration, bus and DMX addresses and the last scene, kept in the EEPROM by eeprom_store.h.
+ *
+ * Changes made over the protocol mark it dirty, and config_task() saves it CONFIG_SAVE_QUIET_MS after the last change, or at most
+ * CONFIG_SAVE_MAX_MS after the first unsaved one while changes keep coming.  A host streaming levels therefore costs one write a minute,
+ * which the store's rotation across its slots turns into years of EEPROM life.  The scene is each channel's level, or its fade target while
+ * fading, plus the running effect.
+ */
+/**
+ * Scene table.
+ *
+ * Up to SCENE_COUNT fixed looks are kept at the top of the EEPROM, with the config store rotating through the space below them.  A scene is
+ * every channel's level plus the channels in firing order, worked out once when it is stored; level_to_counts() is monotonic, so the order
+ * holds at either mains frequency.  recall_scene() therefore refills sorted_commands in place, with no sort, and publishes the schedule at
+ * once, so a single OP_RECALL_SCENE broadcast switches every node on the bus at the same zero cross.  While burst channels, slew limits or
+ * the power-on sequence are in play a recall goes through set_channel_level() instead, which is slower but honours them.
+ */
+struct scene_t {
+  uint8_t crc; // of the rest, seeded with CHANNELS so a build with another channel count doesn't load them
+  uint16_t levels[CHANNELS];
+  uint8_t order[CHANNELS]; // channels by firing time, brightest first
+};
+
+const uint16_t SCENE_MAX_EEPROM = (E2END + 1) / 2; // leave the config store at least half the EEPROM
+const uint8_t SCENE_COUNT = SCENE_MAX_EEPROM / sizeof(scene_t) < 16 ? SCENE_MAX_EEPROM / sizeof(scene_t) : 16;
+const uint16_t SCENE_EEPROM_START = E2END + 1 - SCENE_COUNT * sizeof(scene_t);
+static_assert(sizeof(scene_t) <= STORE_MAX_DATA, "scene_t is too big for store_write_block()");
+
+// words first, then bytes, so a host build pads it no more than avr-gcc does
+struct config_t {
+  uint16_t delay_time;
+  uint16_t dmx_start_address;
+  uint16_t effect_rate;
+  int16_t stagger_offset;
+  uint16_t mains_nominal;
+  uint16_t firing_earliest;
+  uint16_t firing_latest;
+  uint16_t levels[CHANNELS];
+  uint8_t node_id;
+  uint8_t effect;
+  uint8_t stagger;
+  uint8_t burst_channels[CHANNEL_MASK_BYTES];
+  uint8_t slew_limit[CHANNELS];
+  uint8_t host_timeout_s;
+  uint8_t safe_scene;
+  uint8_t watchdog_resets;
+  uint8_t brownout_resets;
+};
+
+static_assert(sizeof(config_t) <= STORE_MAX_DATA, "config_t is too big for the EEPROM store");
+
+// layout version in the high byte and the channel count in the low, so builds with another channel count start fresh
+const uint16_t CONFIG_VERSION = 9 << 8 | CHANNELS;
+const uint16_t CONFIG_SAVE_QUIET_MS = 5000;
+const uint16_t CONFIG_SAVE_MAX_MS = 60000;
+
+bool config_dirty = false;
+uint16_t config_first_change_ms;
+uint16_t config_last_change_ms;
+
+void config_changed() {
+  uint16_t now = millis();
+  if(!config_dirty) {
+    config_dirty = true;
+    config_first_change_ms = now;
+  }
+  config_last_change_ms = now;
+}
+
+/**
+ * @brief Restore the saved configuration and scene, if there is one; otherwise the compiled-in defaults stand.
+ */
+void load_config() {
+  config_t config;
+  if(!store_begin(&config, sizeof(config), CONFIG_VERSION, SCENE_EEPROM_START)) {
     return;
   }
+  delay_time = config.delay_time;
+  tasks[TASK_TELEMETRY].interval_ms = delay_time ? delay_time : TASK_DISABLED;
+  node_id = config.node_id;
+  dmx_start_address = config.dmx_start_address;
+  effect = config.effect;
+  if(effect > EFFECT_DUAL_SINE) {
+    effect = EFFECT_NONE;
+  }
+  effect_rate = config.effect_rate;
+  stagger = config.stagger;
+  stagger_offset = config.stagger_offset;
+  mains_nominal = config.mains_nominal;
+  set_firing_window(config.firing_earliest, config.firing_latest);
+  host_timeout_s = config.host_timeout_s;
+  safe_scene = config.safe_scene;
+  watchdog_resets = config.watchdog_resets;
+  brownout_resets = config.brownout_resets;
+  for(int i = 0; i < CHANNELS; i++) {
+    channel_level[i] = config.levels[i];
+    slew_limit[i] = config.slew_limit[i];
+    set_channel_burst(i, config.burst_channels[i / 8] & (1 << (i % 8)));
+  }
+}
 
-  for(int i = 0; i < 8; i++) {
-    if (lux[i] <= clock_tick)
-    {
-      digitalWrite(pin_assignments[i], HIGH); // triac firing
-    }
+void save_config() {
+  config_t config;
+  config.delay_time = delay_time;
+  config.node_id = node_id;
+  config.dmx_start_address = dmx_start_address;
+  config.effect = effect;
+  config.effect_rate = effect_rate;
+  config.stagger = stagger;
+  config.stagger_offset = stagger_offset;
+  config.mains_nominal = mains_nominal;
+  config.firing_earliest = firing_earliest;
+  config.firing_latest = firing_latest;
+  config.host_timeout_s = host_timeout_s;
+  config.safe_scene = safe_scene;
+  config.watchdog_resets = watchdog_resets;
+  config.brownout_resets = brownout_resets;
+  for(int b = 0; b < CHANNEL_MASK_BYTES; b++) {
+    config.burst_channels[b] = burst_channels[b];
+  }
+  for(int i = 0; i < CHANNELS; i++) {
+    config.slew_limit[i] = slew_limit[i];
+  }
+  for(int i = 0; i < CHANNELS; i++) {
+    config.levels[i] = fade_remaining[i] ? fade_target[i] : channel_level[i];
+  }
+  store_save(&config);
+}
+
+/**
+ * @brief Every pass: feed any save in progress to the EEPROM a byte at a time, and start a save once changes have settled.
+ */
+void config_task() {
+  if(store_busy()) {
+    store_poll();
+    return;
+  }
+  if(!config_dirty) {
+    return;
+  }
+  uint16_t now = millis();
+  if((uint16_t)(now - config_last_change_ms) >= CONFIG_SAVE_QUIET_MS || (uint16_t)(now - config_first_change_ms) >= CONFIG_SAVE_MAX_MS) {
+    config_dirty = false;
+    save_config();
+  }
+}
+
+uint8_t scene_crc(const scene_t *scene) {
+  const uint8_t *bytes = (const uint8_t *)scene;
+  uint8_t crc = CHANNELS;
+  for(uint8_t i = 1; i < sizeof(scene_t); i++) {
+    crc = crc8_update(crc, bytes[i]);
+  }
+  return crc;
+}
+
+/**
+ * @brief Save the current levels (fade targets while fading) as a scene, written in the background by config_task().
+ *
+ * @return false if the scene number is out of range or an earlier scene is still being written
+ */
+bool store_scene(uint8_t number) {
+  if(number >= SCENE_COUNT) {
+    return false;
   }
-  delayMicroseconds(5); // triac On propogation delay (for 60Hz use 8.33)
-  for(int i = 0; i < 8; i++) {
-    if (lux[i] <= clock_tick)
-    {
-      digitalWrite(pin_assignments[i], LOW); // triac Off
+  scene_t scene;
+  for(int i = 0; i < CHANNELS; i++) {
+    scene.levels[i] = fade_remaining[i] ? fade_target[i] : channel_level[i];
+  }
+  // insertion sort into firing order: a higher level fires earlier, and off channels end up last
+  for(int i = 0; i < CHANNELS; i++) {
+    int j = i;
+    while(j > 0 && scene.levels[scene.order[j-1]] < scene.levels[i]) {
+      scene.order[j] = scene.order[j-1];
+      j--;
     }
+    scene.order[j] = i;
   }
+  scene.crc = scene_crc(&scene);
+  return store_write_block(SCENE_EEPROM_START + number * sizeof(scene_t), &scene, sizeof(scene));
 }
 
-bool toggly_State = false;
-int next_command = 0;
+/**
+ * @return false if the scene number is out of range or the scene was never stored
+ */
+bool read_scene(uint8_t number, scene_t *scene) {
+  if(number >= SCENE_COUNT) {
+    return false;
+  }
+  eeprom_read_block(scene, (const void *)(uintptr_t)(SCENE_EEPROM_START + number * sizeof(scene_t)), sizeof(scene_t));
+  return scene->crc == scene_crc(scene);
+}
 
-ISR(TIMER1_COMPA_vect) {
-  // toggly_State = !toggly_State;
-  digitalWrite(led, next_command % 2 == 0 ? HIGH : LOW);
-  int first_command = next_command;
-  while(commands[next_command] <= TCNT1+64) { // 64 is the minimum counts between interrupts
-    digitalWrite(pin_assignments[commands[next_command] & 0b111], HIGH);
-    next_command++;
-    if(next_command >= 8) {
-      break;
+/**
+ * @brief Switch every channel to a stored scene from the next zero cross, stopping any effect or fade.
+ *
+ * @return false if the scene number is out of range or the scene was never stored
+ */
+bool recall_scene(uint8_t number) {
+  scene_t scene;
+  if(!read_scene(number, &scene)) {
+    return false;
+  }
+  effect = EFFECT_NONE;
+  bool direct = channels_powered == CHANNELS;
+  for(int b = 0; b < CHANNEL_MASK_BYTES; b++) {
+    direct &= burst_channels[b] == 0;
+  }
+  for(int i = 0; i < CHANNELS; i++) {
+    fade_cancel(i);
+    direct &= slew_limit[i] == 0;
+  }
+  if(direct) {
+    for(int k = 0; k < CHANNELS; k++) {
+      uint8_t channel = scene.order[k];
+      uint16_t counts = level_to_counts(scene.levels[channel]);
+      channel_level[channel] = scene.levels[channel];
+      target_counts[channel] = counts;
+      sorted_commands.times[k] = counts;
+      sorted_commands.channels[k] = channel;
     }
+    schedule_dirty = true;
+  } else {
+    for(int i = 0; i < CHANNELS; i++) {
+      set_channel_level(i, scene.levels[i]);
+    }
+  }
+  update_schedule();
+  config_changed();
+  return true;
+}
+
+/**
+ * @brief Count this boot's reset cause and start the watchdog.  Called at the end of setup(), once config_t is loaded.
+ */
+void begin_supervisor() {
+  if((reset_flags & (1 << WDRF)) && watchdog_resets < 0xff) {
+    watchdog_resets++;
+    config_changed();
   }
-  delayMicroseconds(5); // triac On propogation delay (for 60Hz use 8.33).  I feel this is a hack, but it works.  64 counts = 32ms > 5us?
-  for(int i = first_command; i < next_command; i++) {
-    digitalWrite(pin_assignments[commands[i] & 0b111], LOW);
+  if((reset_flags & (1 << BORF)) && brownout_resets < 0xff) {
+    brownout_resets++;
+    config_changed();
   }
-  OCR1A = commands[next_command]; // set up next interrupt
+  host_last_ms = millis();
+#ifndef NO_WATCHDOG
+  wdt_enable(WATCHDOG_TIMEOUT);
+#endif
 }
 
-void initialize_timer1() {
-  cli(); // stop interrupts
-  TCCR1A = 0; // set entire TCCR1A register to 0
-  TCCR1B = 0; // same for TCCR1B
-  TCNT1  = 0; // initialize counter value to 0
-  // set compare match register for 60Hz increments
-  OCR1A = 166;
+/**
+ * @brief Record that the host is alive: any frame for this node, or a DMX packet.
+ */
+void host_heartbeat() {
+  host_last_ms = millis();
+  host_lost = false;
+}
 
-  // turn on CTC mode
-  // TCCR1B |= (1 << WGM12);
-  // Set CS11 bit for 8 prescaler
-  TCCR1B |= (1 << CS11);
-  // enable timer compare interrupt
-  TIMSK1 |= (1 << OCIE1A);
-  sei(); // allow interrupts
+/**
+ * @brief Fade every channel to the safe scene when the host stops talking.
+ */
+void host_timed_out() {
+  host_lost = true;
+  effect = EFFECT_NONE;
+  scene_t scene;
+  bool stored = safe_scene != SAFE_SCENE_OFF && read_scene(safe_scene, &scene);
+  uint32_t half_cycles = (uint32_t)HOST_TIMEOUT_FADE_MS * mains_hz / 500;
+  for(int i = 0; i < CHANNELS; i++) {
+    fade_channel(i, stored ? scene.levels[i] : 0, half_cycles);
+  }
+  config_changed(); // so a power cut before the host returns comes back to the safe scene too
 }
 
-int led_State = LOW;
-uint16_t previous_zero_cross = 0;
+/**
+ * @brief Every pass: the watchdog, then the host timeout.
+ */
+void supervisor_task() {
+  if(isr_heartbeat) {
+    isr_heartbeat = false;
+    wdt_reset();
+  }
+  if(host_timeout_s == 0 || host_lost) {
+    return;
+  }
+  if(millis() - host_last_ms >= (uint32_t)host_timeout_s * 1000) {
+    host_timed_out();
+  }
+}
 
-void zero_cross_int() // function to be fired at the zero crossing to dim the light
-{
-  // Every zerocrossing interrupt: For 50Hz (1/2 Cycle) => 10ms ; For 60Hz (1/2 Cycle) => 8.33ms
-  // 10ms=10000us , 8.33ms=8330us
-  previous_zero_cross = TCNT1;
-  if(TCNT1 < 1000) {
+/**
+ * Idle sleep.
+ *
+ * Once every task has had its turn, loop() sleeps in idle mode (clocks to Timer0, Timer1 and the USART keep running) until the next interrupt:
+ * a received byte, a zero cross or half-cycle start, or Timer0's millis() tick every 1.024ms, which is what paces the interval tasks.  The
+ * check and the sleep are one atomic step, so work queued by an interrupt between them is never slept through.
+ *
+ * idle_permille reports the share of the last second spent asleep.  The sleep time is measured around sleep_cpu(), so it includes the ISR
+ * that woke the CPU and slightly flatters idleness; the firing ISRs themselves are accounted in isr_stats.
+ */
+uint32_t idle_us = 0; // asleep since the last meter update
+uint32_t idle_window_start_us = 0;
+uint16_t idle_permille = 0;
+
+void idle_meter_task() {
+  uint32_t now = micros();
+  uint32_t window = now - idle_window_start_us;
+  idle_permille = idle_us / (window / 1000 + 1);
+  idle_us = 0;
+  idle_window_start_us = now;
+}
+
+bool work_pending() {
+  return uart_available() || effect_last_half_cycle != half_cycle_count;
+}
+
+void idle_sleep() {
+  set_sleep_mode(SLEEP_MODE_IDLE);
+  cli();
+  if(work_pending()) {
+    sei();
     return;
   }
+  uint32_t start = micros();
+  sleep_enable();
+  sei(); // the instruction after sei always runs before any interrupt, so the wake-up can't be lost
+  sleep_cpu();
+  sleep_disable();
+  idle_us += micros() - start;
+}
 
-  clock_tick = 0;
-  next_command = 0;
-  toggly_State = false;
-  digitalWrite(led, LOW);
-  OCR1A = commands[0]; // set up next interrupt
-  TCNT1 = 0;
+/**
+ * Binary control protocol.
+ *
+ * Frame: FRAME_SYNC, opcode, length, payload[length], crc8 of opcode, length and payload (polynomial 0x07).  16-bit values are big-endian.
+ * Frames with a bad CRC or an unexpected length are dropped.  Only requests are answered: setters are silent so a host can stream them.
+ *
+ * - OP_PING: no payload; answered with an empty OP_PING | OP_REPLY
+ * - OP_SET_LEVELS: channel mask (CHANNEL_MASK_BYTES, channel 0 in bit 0 of the first byte), then a 16-bit level (0 off, 0xffff full) for
+ *   each set bit, lowest channel first; stops any effect.  Setting all 8 channels of the default build is a 21 byte frame.
+ * - OP_SET_EFFECT: effect_t, 16-bit rate (phase per half-cycle)
+ * - OP_SET_CONFIG: config_param_t, 16-bit value
+ * - OP_GET_STATUS: no payload; answered with mains_hz, pll_locked, half_period, effect, delay_time and the CHANNELS channel levels
+ * - OP_GET_TELEMETRY: no payload; answered with a telemetry frame (see send_telemetry()).  Setting CONFIG_DELAY_TIME to a non-zero interval
+ *   sends the same frame unprompted every delay_time ms.
+ * - OP_GET_STATS: optional reset flag; answered with the isr_stats counters, the lateness mean, the CRC error and UART overrun
+ *   counts, the CPU's idle share, the mains compensation gain, then the half-cycles blanked by loss of sync, the last reset's MCUSR flags
+ *   and the watchdog and brown-out reset counts (see send_stats() and the supervisor comment).  A non-zero flag zeroes the isr_stats, CRC
+ *   error and overrun counters after they are read.
+ * - OP_SET_NODE_ID: new node_id, saved with the rest of config_t; 0xff leaves the node listening to broadcasts only
+ * - OP_BUS_LEVELS: bus_flags_t, first node, node count, channels per node, then that many 16-bit levels for each node in turn.  Each node
+ *   stages its own slice and ignores the rest; levels are only applied by a commit, so every node on the bus changes at the same zero cross.
+ *   With 8 channels per node one frame carries 11 nodes; larger bays send several frames and commit on the last.
+ * - OP_COMMIT: no payload; apply the staged levels (stopping any effect) from the next zero cross
+ * - OP_SET_MODE: channel mask as for OP_SET_LEVELS, then 0 for phase control or 1 for burst fire (see fire_bursts()) on every set channel
+ * - OP_FADE: channel mask as for OP_SET_LEVELS, 16-bit target level, 16-bit duration in ms; fades every set channel from where it is now to
+ *   the target (see fade_step()), and stops any effect.  OP_SET_LEVELS, OP_COMMIT and OP_SET_EFFECT cancel fades on the channels they set.
+ * - OP_SET_SLEW: channel mask as for OP_SET_LEVELS, then the slew limit for every set channel in SLEW_UNIT_COUNTS per half-cycle, 0 for none
+ * - OP_STORE_SCENE: scene number; saves the current levels as that scene (see store_scene()) and answers with the number and 1, or 0 if
+ *   it is out of range or the previous store hasn't finished writing
+ * - OP_RECALL_SCENE: scene number; switches to it at the next zero cross, stopping any effect or fade.  Meant to be broadcast.
+ *
+ * Scene triggers: outside a frame, the single byte SCENE_TRIGGER | n (0xb0-0xbf) recalls scene n exactly as OP_RECALL_SCENE does, so a
+ * wall panel or a desk macro can switch a whole bus with one byte and no CRC.  With no CRC a noise byte can trigger too, so triggers are
+ * only taken while the parser is in step: from boot, and after a good frame, but not after a CRC error or an oversize length until the
+ * next good frame.  Lines too noisy for that should keep to the framed form.
+ *
+ * Built with -DBUS_MODE the UART drives an RS-485 transceiver (driver enable on BUS_DE_PIN) shared by many nodes, and every frame carries
+ * an address after FRAME_SYNC, covered by the CRC: node_id for unicast or BUS_BROADCAST for every node.  Frames for other nodes are parsed
+ * and dropped, broadcasts are never answered so nodes can't collide, and replies carry the answering node's id.  Without BUS_MODE there is
+ * no address byte and every frame is for this node.
+ */
+const uint8_t FRAME_SYNC = 0xa5;
+const uint8_t FRAME_MAX_PAYLOAD = 192; // an OP_BUS_LEVELS frame for 11 8-channel nodes is 180 bytes
+const uint8_t SCENE_TRIGGER = 0xb0; // or'd with the scene number, see scene triggers above
+static_assert(SCENE_COUNT <= 16, "scene triggers only cover 16 scenes");
+
+enum opcode_t {
+  OP_PING = 0x00,
+  OP_SET_LEVELS = 0x01,
+  OP_SET_EFFECT = 0x02,
+  OP_SET_CONFIG = 0x03,
+  OP_GET_STATUS = 0x04,
+  OP_GET_TELEMETRY = 0x05,
+  OP_GET_STATS = 0x06,
+  OP_SET_NODE_ID = 0x07,
+  OP_BUS_LEVELS = 0x08,
+  OP_COMMIT = 0x09,
+  OP_FADE = 0x0a,
+  OP_SET_MODE = 0x0b,
+  OP_SET_SLEW = 0x0c,
+  OP_STORE_SCENE = 0x0d,
+  OP_RECALL_SCENE = 0x0e,
+  OP_REPLY = 0x80 // or'd into the opcode of an answer
+};
+
+enum config_param_t {
+  CONFIG_DELAY_TIME,
+  CONFIG_FIRING_EARLIEST, // Q0.16 of the half-cycle, firing delay at full brightness (see set_firing_window())
+  CONFIG_FIRING_LATEST, // Q0.16 of the half-cycle, firing delay at the lowest level
+  CONFIG_OFF, // retired with the TimerOne polling thresholds, rejected
+  CONFIG_DMX_ADDRESS, // saved for DMX builds to use, see dmx_start_address
+  CONFIG_STAGGER, // 0 off, anything else on
+  CONFIG_STAGGER_OFFSET, // signed, TCNT1 counts
+  CONFIG_MAINS_NOMINAL, // mean square of the mains sense at nominal voltage, 0 to take the current reading (see update_mains_gain())
+  CONFIG_HOST_TIMEOUT, // seconds without a frame before fading to the safe scene, 0 for never (see the supervisor comment)
+  CONFIG_SAFE_SCENE // scene to fade to on host timeout, 0xff for off
+};
+
+enum bus_flags_t {
+  BUS_COMMIT = 0x01 // commit as soon as this frame's levels are staged
+};
+
+uint16_t staged_level[CHANNELS]; // OP_BUS_LEVELS waiting for OP_COMMIT
+bool levels_staged = false;
+
+enum parse_state_t {
+  PARSE_SYNC,
+  PARSE_ADDRESS,
+  PARSE_OPCODE,
+  PARSE_LENGTH,
+  PARSE_PAYLOAD,
+  PARSE_CRC
+};
+
+uint8_t parse_state = PARSE_SYNC;
+uint8_t frame_address;
+uint8_t frame_opcode;
+uint8_t frame_length;
+uint8_t frame_received;
+uint8_t frame_crc;
+uint8_t frame_payload[FRAME_MAX_PAYLOAD];
+uint16_t frame_crc_errors = 0;
+bool replies_muted = false; // handling a broadcast
+bool parse_in_step = true; // no framing error since the last good frame, so scene triggers can be trusted
+
+uint16_t read_u16(const uint8_t *p) {
+  return (uint16_t)p[0] << 8 | p[1];
 }
 
+uint8_t *write_u16(uint8_t *p, uint16_t value) {
+  p[0] = value >> 8;
+  p[1] = value & 0xff;
+  return p + 2;
+}
 
-void setup() {
-  for(int i = 0; i < 8; i++) {
-    pinMode(pin_assignments[i], OUTPUT);
-    lux[i] = off;
+void send_frame(uint8_t opcode, const uint8_t *payload, uint8_t length) {
+  if(replies_muted) {
+    return;
   }
-  pinMode(SYNC_PIN, INPUT_PULLUP); // for firing angle control
-  pinMode(led, OUTPUT);
-  attachInterrupt(digitalPinToInterrupt(SYNC_PIN), zero_cross_int, RISING);
+  uint8_t crc = 0;
+#ifdef BUS_MODE
+  crc = crc8_update(crc, node_id);
+#endif
+  crc = crc8_update(crc8_update(crc, opcode), length);
+  for(int i = 0; i < length; i++) {
+    crc = crc8_update(crc, payload[i]);
+  }
+  uart_write(FRAME_SYNC);
+#ifdef BUS_MODE
+  uart_write(node_id);
+#endif
+  uart_write(opcode);
+  uart_write(length);
+  uart_write(payload, length);
+  uart_write(crc);
+}
 
-  initialize_timer1();
-  // Timer1.initialize(41); // set a timer of length 100 microseconds for 50Hz or 83 microseconds for 60Hz;
-  // Timer1.attachInterrupt( timerIsr ); // attach the service routine here
-  Serial.begin(115200);
-}
-
-void set_lux(int i) {
-  lux[0] = i;
-}
-
-// listen for serial commands
-void serialEvent() {
-  while (Serial.available()) {
-    char inChar = (char)Serial.read();
-    if (inChar == 'u') {
-      delay_time -= 10;
-      Serial.print("delay_time: ");
-      Serial.println(delay_time);
-    } else if (inChar == 'd') {
-      delay_time += 10;
-      Serial.print("delay_time: ");
-      Serial.println(delay_time);
-    } else if (inChar == 'l') {
-      low -= 10;
-      Serial.print("low: ");
-      Serial.println(low);
-    } else if (inChar == 'h') {
-      low += 10;
-      Serial.print("low: ");
-      Serial.println(low);
-    } else if (inChar == 'o') {
-      off -= 10;
-      Serial.print("off: ");
-      Serial.println(off);
-    } else if (inChar == 'f') {
-      off += 10;
-      Serial.print("off: ");
-      Serial.println(off);
-    } else if (inChar == 's') {
-      Serial.print("delay_time: ");
-      Serial.println(delay_time);
-      Serial.print("low: ");
-      Serial.println(low);
-      Serial.print("off: ");
-      Serial.println(off);
+/**
+ * @brief Set the masked channels' levels.  Like commit_levels(), the schedule is published straight away rather than by the next
+ * half_cycle_task(), so the new levels fire from the next zero cross.
+ */
+void set_levels_frame(const uint8_t *payload, uint8_t length) {
+  if(length < CHANNEL_MASK_BYTES) {
+    return;
+  }
+  const uint8_t *mask = payload;
+  uint8_t expected = CHANNEL_MASK_BYTES;
+  for(int i = 0; i < CHANNELS; i++) {
+    if(mask[i / 8] & (1 << (i % 8))) {
+      expected += 2;
+    }
+  }
+  if(length != expected) {
+    return;
+  }
+  effect = EFFECT_NONE;
+  const uint8_t *p = payload + CHANNEL_MASK_BYTES;
+  for(int i = 0; i < CHANNELS; i++) {
+    if(mask[i / 8] & (1 << (i % 8))) {
+      fade_cancel(i);
+      set_channel_level(i, read_u16(p));
+      p += 2;
     }
   }
+  update_schedule();
+  config_changed();
 }
 
-int t = 0;
+/**
+ * @brief Apply the staged levels.  The new schedule is published straight away, so it fires from the next zero cross.
+ */
+void commit_levels() {
+  if(!levels_staged) {
+    return;
+  }
+  effect = EFFECT_NONE;
+  for(int i = 0; i < CHANNELS; i++) {
+    fade_cancel(i);
+    set_channel_level(i, staged_level[i]);
+  }
+  levels_staged = false;
+  update_schedule();
+  config_changed();
+}
 
-void loop() {
-  // put your main code here, to run repeatedly:
-  serialEvent();
-  float pit = 2*3.1415926535897932384626433832795*t/1024.0;
-  t++;
-  if(t >= 1024) {
-    t = 0;
-  }
-  int16_t newcommands[] = {0, 0, 0, 0, 0, 0, 0, 0};
-  for(int i = 0; i < 8; i++ ) {
-    float x = (1+sin(pit+i))*0.5*(1+sin(pit+i*1.61))*0.5; // make it more 0 than 1
-    lux[i] = (high + (low - high)*(1-x)) * 166;
-    // Serial.println(lux[i]);
-    newcommands[i] = (lux[i] & ~(0b111)) | i;
-  }
-  // sort newcommands
-  for(int i = 0; i < 8; i++) {
-    int16_t min = newcommands[i];
-    int16_t min_index = i;
-    for(int j = i+1; j < 8; j++) {
-      if(newcommands[j] < min) {
-        min = newcommands[j];
-        min_index = j;
+/**
+ * @brief Stage this node's slice of an OP_BUS_LEVELS frame, committing it if the frame says so.
+ *
+ * Channels beyond the frame's channels per node keep their current level; levels beyond CHANNELS are skipped.
+ */
+void bus_levels_frame(const uint8_t *payload, uint8_t length) {
+  if(length < 4) {
+    return;
+  }
+  uint8_t flags = payload[0];
+  uint8_t first_node = payload[1];
+  uint8_t node_count = payload[2];
+  uint8_t per_node = payload[3];
+  if(length != 4 + 2 * (uint16_t)node_count * per_node) {
+    return;
+  }
+  if(node_id != BUS_BROADCAST && node_id >= first_node && node_id - first_node < node_count) {
+    if(!levels_staged) {
+      for(int i = 0; i < CHANNELS; i++) {
+        staged_level[i] = channel_level[i];
       }
+      levels_staged = true;
+    }
+    const uint8_t *p = payload + 4 + 2 * (uint16_t)(node_id - first_node) * per_node;
+    for(int i = 0; i < per_node && i < CHANNELS; i++) {
+      staged_level[i] = read_u16(p + 2 * i);
+    }
+  }
+  if(flags & BUS_COMMIT) {
+    commit_levels();
+  }
+}
+
+void fade_frame(const uint8_t *payload, uint8_t length) {
+  if(length != CHANNEL_MASK_BYTES + 4) {
+    return;
+  }
+  const uint8_t *mask = payload;
+  uint16_t target = read_u16(payload + CHANNEL_MASK_BYTES);
+  uint32_t duration_ms = read_u16(payload + CHANNEL_MASK_BYTES + 2);
+  uint32_t half_cycles = duration_ms * mains_hz / 500;
+  effect = EFFECT_NONE;
+  for(int i = 0; i < CHANNELS; i++) {
+    if(mask[i / 8] & (1 << (i % 8))) {
+      fade_channel(i, target, half_cycles);
+    }
+  }
+  config_changed();
+}
+
+void set_mode_frame(const uint8_t *payload, uint8_t length) {
+  if(length != CHANNEL_MASK_BYTES + 1 || payload[CHANNEL_MASK_BYTES] > 1) {
+    return;
+  }
+  for(int i = 0; i < CHANNELS; i++) {
+    if(payload[i / 8] & (1 << (i % 8))) {
+      set_channel_burst(i, payload[CHANNEL_MASK_BYTES]);
+    }
+  }
+  update_schedule();
+  config_changed();
+}
+
+void set_slew_frame(const uint8_t *payload, uint8_t length) {
+  if(length != CHANNEL_MASK_BYTES + 1) {
+    return;
+  }
+  for(int i = 0; i < CHANNELS; i++) {
+    if(payload[i / 8] & (1 << (i % 8))) {
+      slew_limit[i] = payload[CHANNEL_MASK_BYTES];
     }
-    int16_t temp = newcommands[i];
-    newcommands[i] = newcommands[min_index];
-    newcommands[min_index] = temp;
   }
-  // copy newcommands to commands
-  for(int i = 0; i < 8; i++) {
-    commands[i] = newcommands[i];
+  slewing = true; // a lifted limit takes effect on the next step
+  config_changed();
+}
+
+/**
+ * @brief Apply an OP_SET_CONFIG parameter.  Unknown or retired parameters and out-of-range values are rejected: nothing changes and nothing is
+ * saved.
+ */
+void set_config(uint8_t param, uint16_t value) {
+  switch(param) {
+    case CONFIG_FIRING_EARLIEST:
+    case CONFIG_FIRING_LATEST:
+      if(!set_firing_window(param == CONFIG_FIRING_EARLIEST ? value : firing_earliest, param == CONFIG_FIRING_LATEST ? value : firing_latest)) {
+        return;
+      }
+      rescale_channels();
+      break;
+    case CONFIG_DELAY_TIME:
+      delay_time = value;
+      tasks[TASK_TELEMETRY].interval_ms = value ? value : TASK_DISABLED;
+      break;
+    case CONFIG_STAGGER:
+      stagger = value;
+      schedule_dirty = true;
+      break;
+    case CONFIG_HOST_TIMEOUT:
+      host_timeout_s = value < 0xff ? value : 0xff;
+      break;
+    case CONFIG_SAFE_SCENE:
+      safe_scene = value < SCENE_COUNT ? value : SAFE_SCENE_OFF;
+      break;
+    case CONFIG_MAINS_NOMINAL:
+      mains_nominal = value;
+      mains_calibrate = value == 0;
+      break;
+    case CONFIG_STAGGER_OFFSET:
+      stagger_offset = value;
+      schedule_dirty = true;
+      break;
+    case CONFIG_DMX_ADDRESS:
+      if(value < 1 || value + CHANNELS - 1 > DMX_UNIVERSE_SIZE) {
+        return;
+      }
+      dmx_start_address = value; // from the next boot
+      break;
+    default:
+      return; // includes CONFIG_OFF
+  }
+  update_schedule(); // a new stagger fires from the next zero cross
+  config_changed();
+}
+
+void send_status() {
+  uint8_t payload[7 + 2 * CHANNELS];
+  uint8_t *p = payload;
+  *p++ = mains_hz;
+  *p++ = pll_locked;
+  p = write_u16(p, half_period);
+  *p++ = effect;
+  p = write_u16(p, delay_time);
+  for(int i = 0; i < CHANNELS; i++) {
+    p = write_u16(p, channel_level[i]);
+  }
+  send_frame(OP_GET_STATUS | OP_REPLY, payload, p - payload);
+}
+
+/**
+ * @brief Snapshot the ISR counters, optionally zeroing them, without the ISRs seeing a half-written struct.
+ */
+isr_stats_t read_isr_stats(bool reset) {
+  noInterrupts();
+  isr_stats_t stats = isr_stats;
+  if(reset) {
+    isr_stats = {0, 0xffff, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+  }
+  interrupts();
+  return stats;
+}
+
+/**
+ * @brief Answer OP_GET_STATS: fires, lateness min/max/mean, late_slots, missed_slots, rejected_edges, half_cycles, frame_crc_errors,
+ * uart_rx_overruns, idle_permille, masked_glitches, coasted_edges, mains_gain and sync_losses, all 16-bit, then reset_flags,
+ * watchdog_resets and brownout_resets as bytes.
+ */
+void send_stats(bool reset) {
+  isr_stats_t stats = read_isr_stats(reset);
+  noInterrupts();
+  uint16_t overruns = uart_rx_overruns;
+  if(reset) {
+    uart_rx_overruns = 0;
+  }
+  interrupts();
+  uint8_t payload[33];
+  uint8_t *p = payload;
+  p = write_u16(p, stats.fires);
+  p = write_u16(p, stats.lateness_min);
+  p = write_u16(p, stats.lateness_max);
+  p = write_u16(p, stats.fires ? stats.lateness_sum / stats.fires : 0);
+  p = write_u16(p, stats.late_slots);
+  p = write_u16(p, stats.missed_slots);
+  p = write_u16(p, stats.rejected_edges);
+  p = write_u16(p, stats.half_cycles);
+  p = write_u16(p, frame_crc_errors);
+  p = write_u16(p, overruns);
+  p = write_u16(p, idle_permille);
+  p = write_u16(p, stats.masked_glitches);
+  p = write_u16(p, stats.coasted_edges);
+  p = write_u16(p, mains_gain);
+  p = write_u16(p, stats.sync_losses);
+  *p++ = reset_flags;
+  *p++ = watchdog_resets;
+  *p++ = brownout_resets;
+  if(reset) {
+    frame_crc_errors = 0;
+  }
+  send_frame(OP_GET_STATS | OP_REPLY, payload, p - payload);
+}
+
+void handle_frame(uint8_t opcode, const uint8_t *payload, uint8_t length) {
+  host_heartbeat();
+  switch(opcode) {
+    case OP_PING:
+      send_frame(OP_PING | OP_REPLY, 0, 0);
+      break;
+    case OP_SET_LEVELS:
+      set_levels_frame(payload, length);
+      break;
+    case OP_SET_EFFECT:
+      if(length == 3 && payload[0] <= EFFECT_DUAL_SINE) {
+        effect = payload[0];
+        effect_rate = read_u16(payload + 1);
+        for(int i = 0; i < CHANNELS; i++) {
+          fade_cancel(i);
+        }
+        config_changed();
+      }
+      break;
+    case OP_SET_CONFIG:
+      if(length == 3) {
+        set_config(payload[0], read_u16(payload + 1));
+      }
+      break;
+    case OP_GET_STATUS:
+      send_status();
+      break;
+    case OP_GET_TELEMETRY:
+      send_telemetry();
+      break;
+    case OP_GET_STATS:
+      send_stats(length >= 1 && payload[0]);
+      break;
+    case OP_SET_NODE_ID:
+      if(length == 1) {
+        node_id = payload[0];
+        config_changed();
+      }
+      break;
+    case OP_BUS_LEVELS:
+      bus_levels_frame(payload, length);
+      break;
+    case OP_COMMIT:
+      commit_levels();
+      break;
+    case OP_FADE:
+      fade_frame(payload, length);
+      break;
+    case OP_SET_MODE:
+      set_mode_frame(payload, length);
+      break;
+    case OP_SET_SLEW:
+      set_slew_frame(payload, length);
+      break;
+    case OP_STORE_SCENE:
+      if(length == 1) {
+        uint8_t reply[2] = {payload[0], store_scene(payload[0])};
+        send_frame(OP_STORE_SCENE | OP_REPLY, reply, sizeof(reply));
+      }
+      break;
+    case OP_RECALL_SCENE:
+      if(length == 1) {
+        recall_scene(payload[0]);
+      }
+      break;
+  }
+}
+
+/**
+ * @brief Feed one received byte through the frame parser, dispatching any frame it completes.
+ */
+void parse_byte(uint8_t byte) {
+  switch(parse_state) {
+    case PARSE_SYNC:
+      if((byte & 0xf0) == SCENE_TRIGGER && parse_in_step) {
+        host_heartbeat();
+        recall_scene(byte & 0x0f);
+      } else if(byte == FRAME_SYNC) {
+        frame_crc = 0;
+#ifdef BUS_MODE
+        parse_state = PARSE_ADDRESS;
+#else
+        frame_address = node_id;
+        parse_state = PARSE_OPCODE;
+#endif
+      }
+      break;
+    case PARSE_ADDRESS:
+      frame_address = byte;
+      frame_crc = crc8_update(frame_crc, byte);
+      parse_state = PARSE_OPCODE;
+      break;
+    case PARSE_OPCODE:
+      frame_opcode = byte;
+      frame_crc = crc8_update(frame_crc, byte);
+      parse_state = PARSE_LENGTH;
+      break;
+    case PARSE_LENGTH:
+      frame_length = byte;
+      frame_received = 0;
+      frame_crc = crc8_update(frame_crc, byte);
+      parse_state = byte > FRAME_MAX_PAYLOAD ? PARSE_SYNC : byte == 0 ? PARSE_CRC : PARSE_PAYLOAD;
+      parse_in_step &= byte <= FRAME_MAX_PAYLOAD;
+      break;
+    case PARSE_PAYLOAD:
+      frame_payload[frame_received++] = byte;
+      frame_crc = crc8_update(frame_crc, byte);
+      if(frame_received == frame_length) {
+        parse_state = PARSE_CRC;
+      }
+      break;
+    case PARSE_CRC:
+      parse_in_step = byte == frame_crc;
+      if(byte == frame_crc) {
+        if(frame_address == node_id || frame_address == BUS_BROADCAST) {
+#ifdef BUS_MODE
+          replies_muted = frame_address == BUS_BROADCAST;
+#endif
+          handle_frame(frame_opcode, frame_payload, frame_length);
+          replies_muted = false;
+        }
+      } else {
+        frame_crc_errors++;
+      }
+      parse_state = PARSE_SYNC;
+      break;
+  }
+}
+
+// consume whatever has arrived since the last pass
+void process_serial() {
+  while (uart_available()) {
+    parse_byte(uart_read());
+  }
+}
+
+/**
+ * @brief Once per half-cycle: track the mains period, advance the effect and fades or pick up DMX levels, and publish any schedule change.
+ */
+void half_cycle_task() {
+  if(effect_last_half_cycle == half_cycle_count) {
+    return;
+  }
+  bool rescale = update_half_period();
+  rescale |= update_mains_gain();
+  if(rescale) {
+    rescale_channels();
   }
-  // print commands
-  Serial.print(previous_zero_cross, DEC);
-  Serial.print(": ");
-  for(int i = 0; i < 8; i++) {
-    Serial.print(unsigned(commands[i]), DEC);
-    Serial.print(" ");
-    Serial.print((commands[i] & 0b111));
-    Serial.print(";");
+  effect_step();
+  fade_step();
+  dmx_step();
+  slew_step();
+  update_schedule();
+}
 
+/**
+ * @brief Send a telemetry frame: the last zero-cross timestamp, the PLL's half period, the slot count of the schedule being fired and the
+ * sorted firing commands as each firing time then its channel.  Replaces the old per-loop debug print; one 29 byte frame (for 8 channels)
+ * instead of ~25 Serial.print calls.  With -DPOLLING_FALLBACK the timestamp is the edge's time since the one before, and the slot count 0.
+ */
+void send_telemetry() {
+  uint8_t payload[2 + 2 + 1 + 3 * CHANNELS];
+  uint8_t *p = payload;
+  noInterrupts();
+  uint16_t zero_cross = previous_zero_cross;
+  interrupts();
+  p = write_u16(p, zero_cross);
+  p = write_u16(p, half_period);
+#ifdef POLLING_FALLBACK
+  *p++ = 0; // no compare schedule
+#else
+  *p++ = schedules[active_schedule].slots;
+#endif
+  for(int i = 0; i < CHANNELS; i++) {
+    p = write_u16(p, sorted_commands.times[i]);
+    *p++ = sorted_commands.channels[i];
   }
-  Serial.println();
-  
-  serialEvent();
-  delay(delay_time);
+  send_frame(OP_GET_TELEMETRY | OP_REPLY, payload, p - payload);
+}
 
+void loop() {
+  run_tasks();
+  idle_sleep();
 }
\ No newline at end of file
@@ -0,0 +1,133 @@
+/**
+ * @file uart.cpp
+ * @brief Interrupt-driven USART0 driver, see uart.h.
+ */
+
+#include "uart.h"
+
+uint8_t uart_rx_buffer[UART_RX_BUFFER_SIZE];
+volatile uint8_t uart_rx_head = 0; // written by the ISR
+volatile uint8_t uart_rx_tail = 0; // written by uart_read()
+volatile uint16_t uart_rx_overruns = 0;
+
+uint8_t uart_tx_buffer[UART_TX_BUFFER_SIZE];
+volatile uint8_t uart_tx_head = 0; // written by uart_write()
+volatile uint8_t uart_tx_tail = 0; // written by the ISR
+bool uart_tx_written = false; // so uart_flush() doesn't wait on a TXC0 that will never come
+
+volatile uint8_t *uart_de_port = 0; // RS-485 driver enable, if any
+uint8_t uart_de_mask = 0;
+
+void uart_begin(unsigned long baud) {
+  // double speed mode, which gets closest to 115200 from 16MHz (2.1% error, same as HardwareSerial)
+  UCSR0A = (1 << U2X0);
+  UBRR0 = (F_CPU / 4 / baud - 1) / 2;
+  UCSR0C = (1 << UCSZ01) | (1 << UCSZ00); // 8N1
+  UCSR0B = (1 << RXEN0) | (1 << TXEN0) | (1 << RXCIE0);
+}
+
+/**
+ * @brief Switch to half-duplex RS-485: drive de_pin (DE and /RE tied together) high only while transmitting.
+ *
+ * Call after uart_begin().  The pin may share a port with the gate outputs; it is only changed with interrupts off.
+ */
+void uart_rs485(uint8_t de_pin) {
+  pinMode(de_pin, OUTPUT);
+  digitalWrite(de_pin, LOW); // listen
+  uart_de_port = portOutputRegister(digitalPinToPort(de_pin));
+  uart_de_mask = digitalPinToBitMask(de_pin);
+  UCSR0B |= (1 << TXCIE0);
+}
+
+#ifndef DMX_MODE
+// in DMX builds dmx.cpp owns the receiver
+ISR(USART_RX_vect) {
+  uint8_t byte = UDR0;
+  uint8_t next = uart_rx_head + 1;
+  if(next == uart_rx_tail) {
+    uart_rx_overruns++;
+    return;
+  }
+  uart_rx_buffer[uart_rx_head] = byte;
+  uart_rx_head = next;
+}
+#endif
+
+ISR(USART_UDRE_vect) {
+  uint8_t tail = uart_tx_tail;
+  if(tail == uart_tx_head) {
+    UCSR0B &= ~(1 << UDRIE0); // drained
+    return;
+  }
+  UDR0 = uart_tx_buffer[tail];
+  UCSR0A = (UCSR0A & ((1 << U2X0) | (1 << MPCM0))) | (1 << TXC0); // clear transmit complete, keeping the mode bits
+  uart_tx_tail = (tail + 1) & (UART_TX_BUFFER_SIZE - 1);
+}
+
+// only enabled by uart_rs485(): the last byte is out, so release the bus unless more has been queued since
+ISR(USART_TX_vect) {
+  if(uart_tx_head == uart_tx_tail && !(UCSR0B & (1 << UDRIE0))) {
+    *uart_de_port &= ~uart_de_mask;
+  }
+}
+
+uint8_t uart_available() {
+  return uart_rx_head - uart_rx_tail;
+}
+
+/**
+ * @brief Take the next received byte; only call after uart_available() says there is one.
+ */
+uint8_t uart_read() {
+  uint8_t tail = uart_rx_tail;
+  uint8_t byte = uart_rx_buffer[tail];
+  uart_rx_tail = tail + 1;
+  return byte;
+}
+
+/**
+ * @brief Queue a byte for transmission, waiting only if the TX ring is full.
+ */
+void uart_write(uint8_t byte) {
+  uint8_t head = uart_tx_head;
+  uint8_t next = (head + 1) & (UART_TX_BUFFER_SIZE - 1);
+  while(next == uart_tx_tail) {
+    // full: the UDRE interrupt is draining it
+  }
+  uart_tx_buffer[head] = byte;
+  uart_tx_head = next;
+  uart_tx_written = true;
+  // together, so ISR(USART_TX_vect) can't release the bus between the two
+  uint8_t sreg = SREG;
+  cli();
+  if(uart_de_port) {
+    *uart_de_port |= uart_de_mask;
+  }
+  UCSR0B |= (1 << UDRIE0);
+  SREG = sreg;
+}
+
+void uart_write(const uint8_t *data, uint8_t length) {
+  for(uint8_t i = 0; i < length; i++) {
+    uart_write(data[i]);
+  }
+}
+
+/**
+ * @brief Wait until everything queued has left the shift register.
+ */
+void uart_flush() {
+  if(!uart_tx_written) {
+    return;
+  }
+  while(uart_tx_head != uart_tx_tail) {
+  }
+  if(uart_de_port) {
+    // TXC0 is cleared by ISR(USART_TX_vect), which releases the bus once the last byte is out
+    while(*uart_de_port & uart_de_mask) {
+    }
+    return;
+  }
+  while((UCSR0B & (1 << UDRIE0)) || !(UCSR0A & (1 << TXC0))) {
+  }
+}
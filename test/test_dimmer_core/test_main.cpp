@@ -0,0 +1,220 @@
+/**
+ * @file test_main.cpp
+ * @brief Host unit tests for the scheduling core and PLL arithmetic in dimmer_core.h.
+ *
+ * Run with `pio test -e native`.
+ */
+
+#include <unity.h>
+
+#include "dimmer_core.h"
+
+// the default firmware build: 8 channels on the Krida pins, gate masks as PORTB, PORTC, PORTD
+typedef basic_schedule_t<8, 3> schedule_t;
+typedef basic_command_list_t<8> command_list_t;
+static const uint8_t channel_masks[8][3] = {
+  {0x02, 0, 0}, {0x01, 0, 0}, {0, 0, 0x80}, {0, 0, 0x40}, {0, 0, 0x20}, {0, 0, 0x10}, {0, 0, 0x08}, {0x04, 0, 0}
+};
+
+static command_list_t sorted;
+static command_list_t staggered;
+static schedule_t schedule;
+
+void setUp() {
+  clear_commands(&sorted);
+}
+
+void tearDown() {
+}
+
+/**
+ * @brief Channel i at 1000 + 100*i, in order.
+ */
+static void spaced_commands() {
+  for(int i = 0; i < 8; i++) {
+    insert_command(&sorted, i, 1000 + i * 100);
+  }
+}
+
+static void assert_sorted(const command_list_t *list) {
+  for(int i = 1; i < 8; i++) {
+    TEST_ASSERT_TRUE(list->times[i-1] <= list->times[i]);
+  }
+}
+
+static void test_insert_command_moves_later() {
+  spaced_commands();
+  TEST_ASSERT_TRUE(insert_command(&sorted, 0, 1750));
+  assert_sorted(&sorted);
+  TEST_ASSERT_EQUAL_UINT8(0, sorted.channels[7]);
+  TEST_ASSERT_EQUAL_UINT16(1750, sorted.times[7]);
+  TEST_ASSERT_EQUAL_UINT8(1, sorted.channels[0]);
+  TEST_ASSERT_EQUAL_UINT16(1750, command_time(&sorted, 0));
+}
+
+static void test_insert_command_moves_earlier() {
+  spaced_commands();
+  TEST_ASSERT_TRUE(insert_command(&sorted, 7, 500));
+  assert_sorted(&sorted);
+  TEST_ASSERT_EQUAL_UINT8(7, sorted.channels[0]);
+  TEST_ASSERT_EQUAL_UINT16(500, sorted.times[0]);
+  TEST_ASSERT_EQUAL_UINT8(6, sorted.channels[7]);
+}
+
+static void test_insert_command_unchanged() {
+  spaced_commands();
+  TEST_ASSERT_FALSE(insert_command(&sorted, 3, 1300));
+  for(int i = 0; i < 8; i++) {
+    TEST_ASSERT_EQUAL_UINT8(i, sorted.channels[i]);
+  }
+}
+
+static void test_insert_command_off_goes_last() {
+  spaced_commands();
+  TEST_ASSERT_TRUE(insert_command(&sorted, 2, COMMAND_OFF_TIME));
+  assert_sorted(&sorted);
+  TEST_ASSERT_EQUAL_UINT8(2, sorted.channels[7]);
+  TEST_ASSERT_EQUAL_UINT16(COMMAND_OFF_TIME, sorted.times[7]);
+}
+
+static void test_build_schedule_merges_within_window() {
+  insert_command(&sorted, 0, 1000);
+  insert_command(&sorted, 1, 1030);
+  insert_command(&sorted, 2, 1000 + MIN_INTERRUPT_COUNTS); // last one the first slot takes
+  insert_command(&sorted, 3, 1001 + MIN_INTERRUPT_COUNTS);
+  build_schedule(&schedule, &sorted, channel_masks);
+  TEST_ASSERT_EQUAL_UINT8(2, schedule.slots);
+  TEST_ASSERT_EQUAL_UINT16(1000, schedule.times[0]);
+  TEST_ASSERT_EQUAL_UINT16(1001 + MIN_INTERRUPT_COUNTS, schedule.times[1]);
+  TEST_ASSERT_EQUAL_UINT16(0xffff, schedule.times[2]);
+  TEST_ASSERT_EQUAL_UINT8(0x03, schedule.masks[0][0]);
+  TEST_ASSERT_EQUAL_UINT8(0x80, schedule.masks[0][2]);
+  TEST_ASSERT_EQUAL_UINT8(0x40, schedule.masks[1][2]);
+}
+
+static void test_build_schedule_leaves_out_off_channels() {
+  build_schedule(&schedule, &sorted, channel_masks);
+  TEST_ASSERT_EQUAL_UINT8(0, schedule.slots);
+  TEST_ASSERT_EQUAL_UINT16(0xffff, schedule.times[0]);
+
+  spaced_commands();
+  insert_command(&sorted, 7, COMMAND_OFF_TIME);
+  build_schedule(&schedule, &sorted, channel_masks);
+  TEST_ASSERT_EQUAL_UINT8(7, schedule.slots);
+  TEST_ASSERT_EQUAL_UINT16(0xffff, schedule.times[7]);
+  TEST_ASSERT_EQUAL_UINT16(0xffff, schedule.times[8]);
+  for(int i = 0; i < 7; i++) {
+    TEST_ASSERT_EQUAL_UINT8(0, schedule.masks[i][0] & 0x04); // channel 7's gate
+  }
+}
+
+static void test_stagger_commands_spreads_group() {
+  insert_command(&sorted, 0, 5000);
+  insert_command(&sorted, 1, 5000);
+  insert_command(&sorted, 2, 5000);
+  insert_command(&sorted, 3, 8000);
+  stagger_commands(&sorted, &staggered, 0, 0xf000);
+  TEST_ASSERT_EQUAL_UINT16(5000 - STAGGER_COUNTS, staggered.times[0]);
+  TEST_ASSERT_EQUAL_UINT16(5000, staggered.times[1]);
+  TEST_ASSERT_EQUAL_UINT16(5000 + STAGGER_COUNTS, staggered.times[2]);
+  TEST_ASSERT_EQUAL_UINT16(8000, staggered.times[3]);
+  TEST_ASSERT_EQUAL_UINT16(COMMAND_OFF_TIME, staggered.times[4]);
+  for(int i = 0; i < 8; i++) {
+    TEST_ASSERT_EQUAL_UINT8(sorted.channels[i], staggered.channels[i]);
+  }
+
+  build_schedule(&schedule, &staggered, channel_masks);
+  TEST_ASSERT_EQUAL_UINT8(4, schedule.slots); // each its own slot
+}
+
+static void test_stagger_commands_offset() {
+  insert_command(&sorted, 0, 5000);
+  insert_command(&sorted, 1, 5000);
+  stagger_commands(&sorted, &staggered, 100, 0xf000);
+  TEST_ASSERT_EQUAL_UINT16(5100 - STAGGER_COUNTS / 2, staggered.times[0]);
+  TEST_ASSERT_EQUAL_UINT16(5100 + STAGGER_COUNTS / 2, staggered.times[1]);
+}
+
+static void test_stagger_commands_pushes_later_group_back() {
+  insert_command(&sorted, 0, 5000);
+  insert_command(&sorted, 1, 5000 + MIN_INTERRUPT_COUNTS + 1);
+  insert_command(&sorted, 2, 5000 + MIN_INTERRUPT_COUNTS + 1);
+  stagger_commands(&sorted, &staggered, 0, 0xf000);
+  TEST_ASSERT_EQUAL_UINT16(5000, staggered.times[0]);
+  TEST_ASSERT_EQUAL_UINT16(5000 + STAGGER_COUNTS, staggered.times[1]);
+  TEST_ASSERT_EQUAL_UINT16(5000 + 2 * STAGGER_COUNTS, staggered.times[2]);
+}
+
+static void test_stagger_commands_clamps_to_latest() {
+  insert_command(&sorted, 0, 5000);
+  insert_command(&sorted, 1, 5000);
+  insert_command(&sorted, 2, 5000);
+  stagger_commands(&sorted, &staggered, 0, 5010);
+  TEST_ASSERT_EQUAL_UINT16(5000 - STAGGER_COUNTS, staggered.times[0]);
+  TEST_ASSERT_EQUAL_UINT16(5000, staggered.times[1]);
+  TEST_ASSERT_EQUAL_UINT16(5010, staggered.times[2]);
+
+  stagger_commands(&sorted, &staggered, 1000, 5010); // an offset past latest
+  for(int i = 0; i < 3; i++) {
+    TEST_ASSERT_EQUAL_UINT16(5010, staggered.times[i]);
+  }
+}
+
+static void test_pll_phase_error() {
+  TEST_ASSERT_EQUAL_INT16(0, pll_phase_error(0, 19999));
+  TEST_ASSERT_EQUAL_INT16(10, pll_phase_error(10, 19999));
+  TEST_ASSERT_EQUAL_INT16(-10, pll_phase_error(19990, 19999));
+  TEST_ASSERT_EQUAL_INT16(-1, pll_phase_error(19999, 19999));
+}
+
+static void test_pll_in_capture() {
+  TEST_ASSERT_TRUE(pll_in_capture(0));
+  TEST_ASSERT_TRUE(pll_in_capture(PLL_CAPTURE_COUNTS));
+  TEST_ASSERT_TRUE(pll_in_capture(-PLL_CAPTURE_COUNTS));
+  TEST_ASSERT_FALSE(pll_in_capture(PLL_CAPTURE_COUNTS + 1));
+  TEST_ASSERT_FALSE(pll_in_capture(-PLL_CAPTURE_COUNTS - 1));
+}
+
+static void test_pll_acquire_edge() {
+  int32_t period_q8 = (int32_t)20000 << 8;
+  TEST_ASSERT_FALSE(pll_acquire_edge(PLL_MIN_PERIOD - 1, period_q8, 0));
+  TEST_ASSERT_FALSE(pll_acquire_edge(PLL_MAX_PERIOD + 1, period_q8, 0));
+  TEST_ASSERT_TRUE(pll_acquire_edge(20000 + PLL_CAPTURE_COUNTS, period_q8, 3));
+  TEST_ASSERT_FALSE(pll_acquire_edge(20001 + PLL_CAPTURE_COUNTS, period_q8, 3));
+  TEST_ASSERT_TRUE(pll_acquire_edge(20001 + PLL_CAPTURE_COUNTS, period_q8, 0)); // the first edge sets the period
+}
+
+static void test_pll_integrate() {
+  int32_t period_q8 = (int32_t)20000 << 8;
+  TEST_ASSERT_EQUAL_INT32(period_q8 + (32 << (8 - PLL_KI_SHIFT)), pll_integrate(period_q8, 32));
+  TEST_ASSERT_EQUAL_INT32(period_q8 - (32 << (8 - PLL_KI_SHIFT)), pll_integrate(period_q8, -32));
+  TEST_ASSERT_EQUAL_INT32((int32_t)PLL_MAX_PERIOD << 8, pll_integrate((int32_t)PLL_MAX_PERIOD << 8, PLL_CAPTURE_COUNTS));
+  TEST_ASSERT_EQUAL_INT32((int32_t)PLL_MIN_PERIOD << 8, pll_integrate((int32_t)PLL_MIN_PERIOD << 8, -PLL_CAPTURE_COUNTS));
+}
+
+static void test_pll_top() {
+  int32_t period_q8 = (int32_t)20000 << 8;
+  TEST_ASSERT_EQUAL_UINT16(19999, pll_top(period_q8, 0));
+  TEST_ASSERT_EQUAL_UINT16(19999 + 40 / (1 << PLL_KP_SHIFT), pll_top(period_q8, 40));
+  TEST_ASSERT_EQUAL_UINT16(19999 - 40 / (1 << PLL_KP_SHIFT), pll_top(period_q8, -40));
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_insert_command_moves_later);
+  RUN_TEST(test_insert_command_moves_earlier);
+  RUN_TEST(test_insert_command_unchanged);
+  RUN_TEST(test_insert_command_off_goes_last);
+  RUN_TEST(test_build_schedule_merges_within_window);
+  RUN_TEST(test_build_schedule_leaves_out_off_channels);
+  RUN_TEST(test_stagger_commands_spreads_group);
+  RUN_TEST(test_stagger_commands_offset);
+  RUN_TEST(test_stagger_commands_pushes_later_group_back);
+  RUN_TEST(test_stagger_commands_clamps_to_latest);
+  RUN_TEST(test_pll_phase_error);
+  RUN_TEST(test_pll_in_capture);
+  RUN_TEST(test_pll_acquire_edge);
+  RUN_TEST(test_pll_integrate);
+  RUN_TEST(test_pll_top);
+  return UNITY_END();
+}
@@ -0,0 +1,8 @@
+#!/bin/sh
+# Build the isr_cycles env and run it under simavr.  Exits non-zero if any core function or ISR measurement is over its cycle budget, or the
+# run doesn't finish.
+set -e
+cd "$(dirname "$0")/.."
+pio run -e isr_cycles
+SIMAVR=${SIMAVR:-$(command -v simavr || echo "$HOME/.platformio/packages/tool-simavr/bin/simavr")}
+"$SIMAVR" -m atmega328p -f 16000000 .pio/build/isr_cycles/firmware.elf | tee /dev/stderr | grep -q "isr_cycles: PASS"
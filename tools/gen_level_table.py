@@ -0,0 +1,109 @@
+#!/usr/bin/env python3
+"""Generate include/level_table.h: brightness level -> triac firing delay lookup tables, and the power curve for mains compensation.
+
+Each table maps an 8-bit level to the firing delay as a fraction of the half-cycle (0 = zero cross, 65535 = end), so the firmware only has to
+scale by the measured half period.  Level 0 is 0xffff, meaning off.  Levels 1-255 are spread across the usable firing window
+[--earliest, --latest] (percent of the half-cycle, matching the old high/low constants) so that the delivered power rises either linearly
+or along a gamma curve.  The window is emitted too, so the firmware can stretch the tables onto a window calibrated at runtime.
+power_table samples power() at POWER_STEPS + 1 evenly spaced delays, for the firmware to interpolate.
+
+    python3 tools/gen_level_table.py [--earliest 45] [--latest 85] [--gamma 2.2]
+"""
+
+import argparse
+import math
+import os
+
+LEVELS = 256
+POWER_STEPS = 64
+
+
+def power(delay):
+    """Fraction of full power delivered to a resistive load when firing at delay (fraction of the half-cycle)."""
+    angle = delay * math.pi
+    return 1 - delay + math.sin(2 * angle) / (2 * math.pi)
+
+
+def delay_for_power(target):
+    """Invert power() by bisection; power() falls monotonically from 1 to 0 across the half-cycle."""
+    lo, hi = 0.0, 1.0
+    for _ in range(60):
+        mid = (lo + hi) / 2
+        if power(mid) > target:
+            lo = mid
+        else:
+            hi = mid
+    return (lo + hi) / 2
+
+
+def table(earliest, latest, curve):
+    p_max = power(earliest)
+    p_min = power(latest)
+    entries = [0xffff]
+    for level in range(1, LEVELS):
+        x = (level - 1) / (LEVELS - 2)
+        delay = delay_for_power(p_min + (p_max - p_min) * curve(x))
+        entries.append(min(0xfffe, round(delay * 65535)))
+    return entries
+
+
+def power_entries():
+    return [min(0xffff, round(power(i / POWER_STEPS) * 65535)) for i in range(POWER_STEPS + 1)]
+
+
+def emit(name, entries):
+    lines = ["const uint16_t %s[%d] PROGMEM = {" % (name, len(entries))]
+    for i in range(0, len(entries), 8):
+        lines.append("  " + ", ".join("%5d" % e for e in entries[i:i + 8]) + ",")
+    lines.append("};")
+    return "\n".join(lines)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--earliest", type=float, default=45, help="firing delay at full brightness, percent of half-cycle")
+    parser.add_argument("--latest", type=float, default=85, help="firing delay at the lowest level, percent of half-cycle")
+    parser.add_argument("--gamma", type=float, default=2.2, help="exponent for the perceptual table")
+    parser.add_argument("--output", default=os.path.join(os.path.dirname(__file__), "..", "include", "level_table.h"))
+    args = parser.parse_args()
+
+    earliest = args.earliest / 100
+    latest = args.latest / 100
+    linear = table(earliest, latest, lambda x: x)
+    gamma = table(earliest, latest, lambda x: x ** args.gamma)
+
+    with open(args.output, "w") as f:
+        f.write("""/**
+ * @file level_table.h
+ * @brief Brightness level to firing delay lookup tables.
+ *
+ * Generated by tools/gen_level_table.py --earliest %g --latest %g --gamma %g; do not edit by hand.
+ *
+ * Entries are the firing delay as a fraction of the half-cycle (Q0.16); 0xffff means off.  Levels 1-255 run from LEVEL_TABLE_LATEST down
+ * to LEVEL_TABLE_EARLIEST.
+ * - level_table_linear: delivered power rises linearly with level
+ * - level_table_gamma: delivered power follows level^%g, for perceptually even steps
+ *
+ * power_table is the fraction of full power (Q0.16) delivered to a resistive load when firing at delay i/POWER_TABLE_STEPS of the
+ * half-cycle, falling from 0xffff to 0.
+ */
+
+#pragma once
+
+#include <avr/pgmspace.h>
+
+const uint16_t LEVEL_TABLE_EARLIEST = %d; // firing window the tables were generated for, Q0.16
+const uint16_t LEVEL_TABLE_LATEST = %d;
+
+%s
+
+%s
+
+const uint8_t POWER_TABLE_STEPS = %d;
+%s
+""" % (args.earliest, args.latest, args.gamma, args.gamma, round(earliest * 65535), round(latest * 65535),
+       emit("level_table_linear", linear), emit("level_table_gamma", gamma), POWER_STEPS, emit("power_table", power_entries())))
+
+
+if __name__ == "__main__":
+    main()